@@ -19,13 +19,25 @@
 #include "driver/tool.h"
 #include "driver/cl_options.h"
 
+#include <deque>
+#include <stdlib.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 #include "clang/AST/DeclTemplate.h"
+#include "clang/AST/RecordLayout.h"
+#include "clang/AST/RecursiveASTVisitor.h"
 #include "clang/Basic/SourceLocation.h"
 #include "clang/Basic/SourceManager.h"
+#include "clang/Basic/TargetInfo.h"
 #include "clang/Driver/Compilation.h"
 #include "clang/Driver/Driver.h"
 #include "clang/Driver/Tool.h"
 #include "clang/Lex/HeaderSearch.h"
+#include "clang/Lex/Lexer.h"
 #include "clang/Lex/ModuleMap.h"
 #include "clang/Lex/Preprocessor.h"
 #include "clang/Frontend/ASTUnit.h"
@@ -37,7 +49,11 @@
 #include "clang/Serialization/ASTReader.h"
 #include "clang/Serialization/ASTWriter.h"
 #include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitstreamWriter.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Process.h"
 #include "llvm/Support/Program.h"
 #include "llvm/IR/LLVMContext.h"
 
@@ -514,7 +530,10 @@ void LangPlugin::mangleAnonymousAggregate(OutBuffer *buf, ::AggregateDeclaration
 
 /***********************/
 
-void InstantiationChecker::CompletedImplicitDefinition(const clang::FunctionDecl *D)
+unsigned InstantiationChecker::batchDepth = 0;
+bool InstantiationChecker::batchInstantiated = false;
+
+void InstantiationChecker::check()
 {
     if (!calypso.pch.AST)
         return; // we may still be in the initial parsing of headers
@@ -532,21 +551,45 @@ void InstantiationChecker::CompletedImplicitDefinition(const clang::FunctionDecl
     }
 }
 
+void InstantiationChecker::CompletedImplicitDefinition(const clang::FunctionDecl *D)
+{
+    if (batchDepth)
+        batchInstantiated = true;
+    else
+        check();
+}
+
 void InstantiationChecker::FunctionDefinitionInstantiated(const clang::FunctionDecl *D)
 {
-    if (!calypso.pch.AST)
-        return; // we may still be in the initial parsing of headers
+    if (batchDepth)
+        batchInstantiated = true;
+    else
+        check();
+}
 
-    auto& Diags = calypso.getDiagnostics();
+// WORKAROUND for https://llvm.org/bugs/show_bug.cgi?id=24420
+// « RecordDecl::LoadFieldsFromExternalStorage() expels existing decls from the DeclContext linked list »
+// Sema declares implicit members lazily, so a record deserialized from the PCH may get one before its fields
+// were loaded. Loading its lexical decls right away puts the serialized members in front of the new one instead, and
+// leaves nothing for LoadFieldsFromExternalStorage() to load. The records nobody adds to stay unloaded.
+void InstantiationChecker::AddedCXXImplicitMember(const clang::CXXRecordDecl *RD, const clang::Decl *D)
+{
+    if (RD->hasExternalLexicalStorage())
+        RD->decls_begin();
+}
 
-    calypso.pch.needSaving = true;
+void InstantiationChecker::beginBatch()
+{
+    batchDepth++;
+}
 
-    if (Diags.hasErrorOccurred())
+void InstantiationChecker::endBatch()
+{
+    assert(batchDepth);
+    if (--batchDepth == 0 && batchInstantiated)
     {
-//         if (!D->isInvalidDecl())
-//             fprintf(stderr, "Marking %s invalid", D->getNameAsString().c_str());
-//         const_cast<clang::FunctionDecl*>(D)->setInvalidDecl();
-        Diags.Reset();
+        batchInstantiated = false;
+        check();
     }
 }
 
@@ -566,6 +609,32 @@ DiagMuter::~DiagMuter()
 
 #define MAX_FILENAME_SIZE 4096
 
+// Several ldc2 processes may share the cache directory, so cache files are written to a temporary file first, which
+// then gets renamed over the old one. Readers either see the old file or the new one, never a partially written one.
+static std::string createTempCacheFile(const std::string &filename)
+{
+    int FD;
+    llvm::SmallString<128> TmpPath;
+    if (llvm::sys::fs::createUniqueFile(filename + "-%%%%%%%%", FD, TmpPath))
+    {
+        ::error(Loc(), "Temporary file for %s couldn't be created", filename.c_str());
+        fatal();
+    }
+    llvm::sys::Process::SafelyCloseFileDescriptor(FD);
+
+    return TmpPath.str();
+}
+
+static void publishCacheFile(const std::string &tmpFilename, const std::string &filename)
+{
+    if (llvm::sys::fs::rename(tmpFilename, filename))
+    {
+        llvm::sys::fs::remove(tmpFilename, true);
+        ::error(Loc(), "%s couldn't be replaced", filename.c_str());
+        fatal();
+    }
+}
+
 void PCH::init()
 {
     clang::IntrusiveRefCntPtr<clang::DiagnosticOptions> DiagOpts(new clang::DiagnosticOptions);
@@ -575,25 +644,425 @@ void PCH::init()
     Diags = new clang::DiagnosticsEngine(DiagID,
                                          &*DiagOpts, DiagClient);
 
-    auto headerList = calypso.getCacheFilename();
+    readCacheLists();
+}
 
-    auto fheaderList = fopen(headerList.c_str(), "r"); // ordered list of headers
-        // currently cached as one big PCH (neither modules nor chained PCH can be
-        // used without modifying Clang).
-    if (!fheaderList)
+// The cache lists are kept in a single file, so that another process publishing its PCH replaces all of them at once:
+//   the ordered list of headers currently cached as one big PCH, with chained PCHs layered over it for the headers
+//   added since (Clang modules can't be used without modifying Clang), followed by sections starting with a '#' line
+//     #deltas     the chained PCHs, if one of them went missing the whole chain needs to be rebuilt
+//     #modules    <name>\t<module map>\t<module file> of the Clang modules imported by the PCH
+//     #manifest   args <hash of -cpp-args>, then <mtime> <size> <hash> <filename> of every file the PCH depends on
+void PCH::readCacheLists()
+{
+    auto Buffer = llvm::MemoryBuffer::getFile(calypso.getCacheFilename());
+    if (!Buffer)
         return;
 
-    char linebuf[MAX_FILENAME_SIZE];
-    while (fgets(linebuf, MAX_FILENAME_SIZE, fheaderList) != NULL)
+    enum { Headers, Deltas, Modules, Manifest, Skip } section = Headers;
+
+    llvm::SmallVector<llvm::StringRef, 64> Lines;
+    (*Buffer)->getBuffer().split(Lines, '\n', -1, false);
+
+    for (auto Line: Lines)
     {
-        linebuf[strcspn(linebuf, "\n")] = '\0';
-        if (linebuf[0] == '\0')
+        if (Line.startswith("#"))
+        {
+            if (Line == "#deltas")
+                section = Deltas;
+            else if (Line == "#modules")
+                section = Modules;
+            else if (Line == "#manifest")
+                section = Manifest;
+            else
+                section = Skip;
+            continue;
+        }
+
+        switch (section)
+        {
+            case Headers:
+                headers.push(strdup(Line.str().c_str()));
+                cachedHeaders = headers.dim;
+                break;
+
+            case Deltas:
+                if (!llvm::sys::fs::exists(Line))
+                {
+                    deltas.setDim(0);
+                    cachedHeaders = 0;
+                    section = Skip;
+                    break;
+                }
+                deltas.push(strdup(Line.str().c_str()));
+                break;
+
+            case Modules:
+            {
+                llvm::SmallVector<llvm::StringRef, 3> Fields;
+                Line.split(Fields, '\t');
+                if (Fields.size() != 3)
+                    break;
+
+                PrebuiltModule PM;
+                PM.name = Fields[0];
+                PM.moduleMap = Fields[1];
+                PM.moduleFile = Fields[2];
+                prebuiltModules.push_back(PM);
+                break;
+            }
+
+            case Manifest:
+            {
+                if (Line.startswith("args "))
+                {
+                    manifestArgs = Line.substr(5);
+                    break;
+                }
+
+                // <mtime> <size> <hash> <filename>
+                llvm::StringRef mtime, size, hash, filename;
+                std::tie(mtime, filename) = Line.split(' ');
+                std::tie(size, filename) = filename.split(' ');
+                std::tie(hash, filename) = filename.split(' ');
+
+                auto& Entry = manifest[filename];
+                if (filename.empty() || hash.size() != 32 ||
+                        mtime.getAsInteger(10, Entry.mtime) || size.getAsInteger(10, Entry.size))
+                {
+                    // malformed manifest, ignore it and let Clang validate the PCH
+                    manifest.clear();
+                    manifestArgs.clear();
+                    section = Skip;
+                    break;
+                }
+                Entry.hash = hash;
+                break;
+            }
+
+            case Skip:
+                break;
+        }
+    }
+}
+
+void PCH::writeCacheLists()
+{
+    auto cacheList = calypso.getCacheFilename();
+    auto tmpFilename = createTempCacheFile(cacheList);
+    auto fcacheList = fopen(tmpFilename.c_str(), "w");
+    if (fcacheList == NULL)
+    {
+        ::error(Loc(), "C/C++ header list cache file couldn't be opened/created");
+        fatal();
+    }
+
+    for (unsigned i = 0; i < headers.dim; ++i)
+        fprintf(fcacheList, "%s\n", headers[i]);
+
+    fprintf(fcacheList, "#deltas\n");
+    for (unsigned i = 0; i < deltas.dim; ++i)
+        fprintf(fcacheList, "%s\n", deltas[i]);
+
+    fprintf(fcacheList, "#modules\n");
+    for (auto& PM: prebuiltModules)
+        fprintf(fcacheList, "%s\t%s\t%s\n", PM.name.c_str(), PM.moduleMap.c_str(), PM.moduleFile.c_str());
+
+    if (!manifest.empty())
+    {
+        fprintf(fcacheList, "#manifest\nargs %s\n", manifestArgs.c_str());
+        for (auto& Entry: manifest)
+        {
+            auto& Value = Entry.getValue();
+            fprintf(fcacheList, "%llu %llu %s %s\n", (unsigned long long) Value.mtime,
+                        (unsigned long long) Value.size, Value.hash.c_str(), Entry.getKey().str().c_str());
+        }
+    }
+
+    fclose(fcacheList);
+    publishCacheFile(tmpFilename, cacheList);
+}
+
+static std::string hashCppArgs()
+{
+    llvm::MD5 Hash;
+    for (auto& cppArg: opts::cppArgs)
+    {
+        Hash.update(cppArg);
+        Hash.update(llvm::StringRef("\0", 1));
+    }
+
+    llvm::MD5::MD5Result Result;
+    Hash.final(Result);
+
+    llvm::SmallString<32> Str;
+    llvm::MD5::stringifyResult(Result, Str);
+    return Str.str();
+}
+
+static std::string hashBuffer(llvm::StringRef Buffer)
+{
+    llvm::MD5 Hash;
+    Hash.update(Buffer);
+
+    llvm::MD5::MD5Result Result;
+    Hash.final(Result);
+
+    llvm::SmallString<32> Str;
+    llvm::MD5::stringifyResult(Result, Str);
+    return Str.str();
+}
+
+bool PCH::checkManifest()
+{
+    validatedByManifest = false;
+
+    if (manifest.empty())
+        return true; // no manifest, leave it to Clang
+
+    bool clean = true;
+    auto Dirty = [&] (const char *reason, llvm::StringRef filename) {
+        clean = false;
+        if (global.params.verbose)
+            fprintf(global.stdmsg, "dirty     %s (%s)\n", filename.str().c_str(), reason);
+    };
+
+    if (manifestArgs != hashCppArgs())
+        Dirty("-cpp-args changed", "*");
+
+    for (auto& Entry: manifest)
+    {
+        auto filename = Entry.getKey();
+        auto& Value = Entry.getValue();
+
+        llvm::sys::fs::file_status result;
+        if (llvm::sys::fs::status(filename, result) || !llvm::sys::fs::exists(result))
+        {
+            Dirty("missing", filename);
+            continue;
+        }
+
+        if (result.getSize() != Value.size)
+        {
+            Dirty("size changed", filename);
+            continue;
+        }
+
+        if (result.getLastModificationTime().toEpochTime() == Value.mtime)
+            continue;
+
+        // The file was touched, only the contents matter
+        auto Buffer = llvm::MemoryBuffer::getFile(filename);
+        if (!Buffer || hashBuffer((*Buffer)->getBuffer()) != Value.hash)
+            Dirty("contents changed", filename);
+    }
+
+    validatedByManifest = clean;
+    return clean;
+}
+
+void PCH::updateManifest()
+{
+    auto& SrcMgr = AST->getSourceManager();
+
+    manifestArgs = hashCppArgs();
+
+    // Merge the files the PCH depends on into the manifest, the ones from the PCHs this one is chained to should already be in it
+    for (auto I = SrcMgr.fileinfo_begin(), E = SrcMgr.fileinfo_end(); I != E; ++I)
+    {
+        auto FE = I->first;
+        if (!FE)
+            continue;
+
+        bool Invalid = false;
+        auto Buffer = SrcMgr.getMemoryBufferForFile(FE, &Invalid);
+        if (Invalid || !Buffer)
             continue;
 
-        headers.push(strdup(linebuf));
+        auto& Entry = manifest[FE->getName()];
+        Entry.mtime = FE->getModificationTime();
+        Entry.size = FE->getSize();
+        Entry.hash = hashBuffer(Buffer->getBuffer());
+    }
+}
+
+// Identifies the PCH file the decl IDs were read from, replacing the file changes its inode
+static std::string getPCHIdentity(const std::string &filename)
+{
+    llvm::sys::fs::file_status result;
+    if (llvm::sys::fs::status(filename, result))
+        return "";
+
+    auto UID = result.getUniqueID();
+    return "pch " + llvm::utostr(UID.getDevice()) + " " + llvm::utostr(UID.getFile()) + " " +
+            llvm::utostr(result.getSize()) + " " +
+            llvm::utostr(result.getLastModificationTime().toEpochTime());
+}
+
+// True if the PCH this process loaded is still the one in the cache directory, i.e the decl IDs it has are the ones
+// other processes will read
+bool PCH::ownsModuleDecls()
+{
+    return !pchIdentity.empty() && pchIdentity == getPCHIdentity(pchFilename);
+}
+
+// The first line of the .decls file is the identity of the PCH chain its decl IDs belong to
+void PCH::readModuleDecls(uint64_t moduleMapsTime)
+{
+    moduleDecls.clear();
+    moduleDeclsStale = false;
+    moduleDeclsIgnored = true;
+
+    auto declsFilename = calypso.getCacheFilename(".decls");
+
+    llvm::sys::fs::file_status result;
+    if (llvm::sys::fs::status(declsFilename, result) ||
+            result.getLastModificationTime().toEpochTime() < moduleMapsTime)
+        return;
+
+    auto Buffer = llvm::MemoryBuffer::getFile(declsFilename);
+    if (!Buffer)
+        return;
+
+    // <module> <decl ID>...
+    llvm::SmallVector<llvm::StringRef, 64> Lines, Fields;
+    (*Buffer)->getBuffer().split(Lines, '\n', -1, false);
+
+    if (Lines.empty() || pchIdentity.empty() || Lines[0] != pchIdentity)
+        return; // written for another PCH
+
+    for (unsigned l = 1; l < Lines.size(); l++)
+    {
+        Fields.clear();
+        Lines[l].split(Fields, ' ', -1, false);
+
+        std::vector<uint32_t> IDs;
+        for (unsigned i = 1; i < Fields.size(); i++)
+        {
+            uint32_t ID;
+            if (Fields[i].getAsInteger(10, ID))
+            {
+                moduleDecls.clear(); // malformed, ignore the whole file
+                return;
+            }
+            IDs.push_back(ID);
+        }
+
+        moduleDecls[Fields[0]] = std::move(IDs);
+    }
+
+    // Several processes may have appended a line for the same module
+    moduleDeclsIgnored = false;
+    moduleDeclsStale = Lines.size() - 1 > moduleDecls.size();
+}
+
+// Lines are only ever appended to the .decls file, rewrite it with one line per module. The lines appended by other
+// processes since the file was read get lost, but they'll only have to scan these modules again.
+void PCH::writeModuleDecls()
+{
+    if (!ownsModuleDecls())
+        return; // another process published a new PCH, the IDs of this one are meaningless for it
+
+    auto declsFilename = calypso.getCacheFilename(".decls");
+    auto tmpFilename = createTempCacheFile(declsFilename);
+    auto fdecls = fopen(tmpFilename.c_str(), "w");
+    if (!fdecls)
+    {
+        ::error(Loc(), "C++ module decl cache couldn't be rewritten");
+        fatal();
+    }
+
+    fprintf(fdecls, "%s\n", pchIdentity.c_str());
+    for (auto& Entry: moduleDecls)
+    {
+        fputs(Entry.getKey().str().c_str(), fdecls);
+        for (auto ID: Entry.getValue())
+            fprintf(fdecls, " %u", ID);
+        fputc('\n', fdecls);
+    }
+
+    fclose(fdecls);
+    publishCacheFile(tmpFilename, declsFilename);
+
+    moduleDeclsStale = false;
+    moduleDeclsIgnored = false;
+}
+
+bool PCH::lookupModuleDecls(llvm::StringRef moduleName, llvm::SmallVectorImpl<const clang::Decl*> &Decls)
+{
+    auto I = moduleDecls.find(moduleName);
+    if (I == moduleDecls.end())
+        return false;
+
+    auto Source = AST->getASTContext().getExternalSource();
+    if (!Source)
+        return false;
+
+    for (auto ID: I->second)
+    {
+        auto D = Source->GetExternalDecl(ID);
+        if (!D)
+        {
+            Decls.clear();
+            return false;
+        }
+        Decls.push_back(D);
+    }
+
+    return true;
+}
+
+void PCH::cacheModuleDecls(llvm::StringRef moduleName, llvm::ArrayRef<const clang::Decl*> Decls)
+{
+    if (needSaving)
+        return; // the decls parsed during this run will only get their IDs once the PCH is written
+
+    std::vector<uint32_t> IDs;
+    for (auto D: Decls)
+    {
+        if (!D->isFromASTFile())
+            return;
+        IDs.push_back(D->getGlobalID());
+    }
+
+    if (!ownsModuleDecls())
+        return; // another process published a new PCH, the IDs of this one are meaningless for it
+
+    moduleDecls[moduleName] = IDs;
+
+    // The file on disk belongs to an older PCH, or is older than a module map, so start it over
+    auto declsFilename = calypso.getCacheFilename(".decls");
+    if (moduleDeclsIgnored)
+    {
+        writeModuleDecls();
+        return;
+    }
+
+    std::string line = moduleName;
+    for (auto ID: IDs)
+        line += " " + llvm::utostr(ID);
+    line += "\n";
+
+    auto fdecls = fopen(declsFilename.c_str(), "a+");
+    if (!fdecls)
+        return; // not worth failing over
+
+    // Only append if the file was still written for this PCH, the check is made on the opened file since another
+    // process may replace it in the meantime
+    char identity[256];
+    bool samePCH = fgets(identity, sizeof(identity), fdecls) != NULL &&
+            llvm::StringRef(identity).rtrim('\n') == pchIdentity;
+    if (!samePCH)
+    {
+        fclose(fdecls);
+        writeModuleDecls();
+        return;
     }
 
-    fclose(fheaderList);
+    // Unbuffered so that the line gets appended by a single write, other processes may be appending to the file too
+    setvbuf(fdecls, nullptr, _IONBF, 0);
+    fwrite(line.data(), 1, line.size(), fdecls);
+    fclose(fdecls);
 }
 
 void PCH::add(const char* header, ::Module *from)
@@ -626,19 +1095,63 @@ void PCH::add(const char* header, ::Module *from)
     needHeadersReload = true;
 }
 
-void PCH::loadFromHeaders()
+// Another process just published its PCH, take its lists and re-add the headers it lacks on top
+void PCH::reloadCacheLists()
 {
-//     llvm::sys::fs::remove(pchFilenameNew, true);
+    std::vector<const char*> ownHeaders(headers.begin(), headers.end());
+
+    headers.setDim(0);
+    deltas.setDim(0);
+    cachedHeaders = 0;
+    manifest.clear();
+    prebuiltModules.clear();
+    validatedByManifest = false;
+    readCacheLists();
+
+    needHeadersReload = false;
+    for (auto header: ownHeaders)
+    {
+        bool found = false;
+        for (unsigned i = 0; i < headers.dim && !found; i++)
+            found = strcmp(header, headers[i]) == 0;
+
+        if (!found)
+        {
+            headers.push(header);
+            needHeadersReload = true;
+        }
+    }
+}
+
+// Chained PCH writer for the delta PCH, it needs to listen to the AST reader from the start
+// to know which identifiers, types and decls were deserialized from the PCH it is chained to
+class PCHDeltaWriter : public clang::ASTConsumer
+{
+public:
+    llvm::SmallVector<char, 128> Buffer;
+    llvm::BitstreamWriter Stream;
+    clang::ASTWriter Writer;
+
+    PCHDeltaWriter()
+        : Stream(Buffer),
+          Writer(Stream, llvm::ArrayRef<llvm::IntrusiveRefCntPtr<clang::ModuleFileExtension>>()) {}
+
+    clang::ASTMutationListener *GetASTMutationListener() override { return &Writer; }
+    clang::ASTDeserializationListener *GetASTDeserializationListener() override { return &Writer; }
+};
 
+void PCH::writeMonoHeader(const char *filename, unsigned firstHeader)
+{
     // Re-emit the source file with #include directives
-    auto fmono = fopen(pchHeader.c_str(), "w");
+    auto tmpFilename = createTempCacheFile(filename);
+    auto fmono = fopen(tmpFilename.c_str(), "w");
     if (!fmono)
     {
         ::error(Loc(), "C++ monolithic header couldn't be created");
         fatal();
     }
 
-    for (unsigned i = 0; i < headers.dim; ++i)
+    for (unsigned i = firstHeader; i < headers.dim; ++i)
     {
         if (headers[i][0] == '<')
             fprintf(fmono, "#include %s\n", headers[i]);
@@ -647,7 +1160,11 @@ void PCH::loadFromHeaders()
     }
 
     fclose(fmono);
+    publishCacheFile(tmpFilename, filename);
+}
 
+void PCH::initInvocation(clang::CompilerInvocation &CI, const char *header, const char *includePCH)
+{
     // Compiler flags, we use a hack from clang-interpreter to extract -cc1 flags from "puny human" flags
     // The driver doesn't do anything except computing the flags.
     std::string TripleStr = llvm::sys::getProcessTriple();
@@ -666,10 +1183,15 @@ void PCH::loadFromHeaders()
     Argv.push_back("clang");
     for (auto& cppArg: opts::cppArgs)
         Argv.push_back(cppArg.c_str());
+    if (includePCH)
+    {
+        Argv.push_back("-include-pch");
+        Argv.push_back(includePCH);
+    }
     Argv.push_back("-c");
     Argv.push_back("-x");
     Argv.push_back("c++-header");
-    Argv.push_back(pchHeader.c_str());
+    Argv.push_back(header);
 
     std::unique_ptr<clang::driver::Compilation> C(TheDriver.BuildCompilation(Argv));
     assert(C);
@@ -683,70 +1205,321 @@ void PCH::loadFromHeaders()
 
     // Initialize a compiler invocation object from the clang (-cc1) arguments.
     const clang::driver::ArgStringList &CCArgs = Cmd.getArguments();
-    clang::CompilerInvocation CI;
     clang::CompilerInvocation::CreateFromArgs(CI, CCArgs.begin(), CCArgs.end(), *Diags);
 
-    // Parse the headers
-    DiagClient->muted = false;
+    // The headers of the prebuilt modules get imported from their module files instead of being parsed
+    if (!prebuiltModules.empty())
+    {
+        auto& LangOpts = *CI.getLangOpts();
+        LangOpts.Modules = true;
+        LangOpts.ImplicitModules = false;
 
-    llvm::IntrusiveRefCntPtr<clang::vfs::OverlayFileSystem> OverlayFileSystem(
-        new clang::vfs::OverlayFileSystem(clang::vfs::getRealFileSystem()));
-    auto Files = new clang::FileManager(clang::FileSystemOptions(), OverlayFileSystem);
+        auto& FrontendOpts = CI.getFrontendOpts();
+        for (auto& PM: prebuiltModules)
+        {
+            FrontendOpts.ModuleMapFiles.push_back(PM.moduleMap);
+            FrontendOpts.ModuleFiles.push_back(PM.moduleFile);
+        }
+    }
+}
 
-    PCHContainerOps.reset(new clang::PCHContainerOperations);
+bool PCH::buildModule(const PrebuiltModule &PM)
+{
+    auto Invocation = new clang::CompilerInvocation;
+    initInvocation(*Invocation, PM.moduleMap.c_str());
+
+    auto& LangOpts = *Invocation->getLangOpts();
+    LangOpts.Modules = true;
+    LangOpts.ImplicitModules = false;
+    LangOpts.CurrentModule = PM.name;
+
+    auto& FrontendOpts = Invocation->getFrontendOpts();
+    FrontendOpts.Inputs.clear();
+    FrontendOpts.Inputs.emplace_back(PM.moduleMap, clang::IK_CXX);
+    FrontendOpts.OutputFile = PM.moduleFile;
+    FrontendOpts.ProgramAction = clang::frontend::GenerateModule;
+
+    clang::CompilerInstance Clang;
+    Clang.setInvocation(Invocation);
+    Clang.createDiagnostics();
+
+    clang::GenerateModuleAction Action;
+    return Clang.ExecuteAction(Action) &&
+            !Clang.getDiagnostics().hasErrorOccurred();
+}
 
-    AST = ASTUnit::LoadFromCompilerInvocation(&CI, PCHContainerOps, Diags, Files, false, false, false,
-                                              clang::TU_Complete, false, false, false,
-                                              new InstantiationChecker).release();
-    AST->getSema();
-    Diags->getClient()->BeginSourceFile(AST->getLangOpts(), &AST->getPreprocessor());
+// Parsing every header into one PCH only uses one core, so the Clang modules described by the module maps found next
+// to the headers are built beforehand by parallel workers, and the PCH then imports them. A module that fails to
+// build simply gets its headers parsed along with the others.
+void PCH::buildModules()
+{
+    using namespace llvm::sys;
 
-    needSaving = true;
-    DiagClient->muted = !opts::cppVerboseDiags;
+    prebuiltModules.clear();
 
-    /* Update the list of headers */
+    std::vector<PrebuiltModule> Jobs;
+    llvm::StringSet<> CheckedDirs, Names;
 
-    auto headerList = calypso.getCacheFilename();
-    auto fheaderlist = fopen(headerList.c_str(), "w");
-    if (fheaderlist == NULL)
-    {
-        ::error(Loc(), "C/C++ header list cache file couldn't be opened/created");
-        fatal();
-    }
+    // The module maps are parsed by the HeaderSearch of a bare CompilerInstance. HeaderSearch::collectAllModules()
+    // only looks for module.modulemap files, so each .modulemap_d gets loaded explicitly.
+    clang::CompilerInstance Clang;
+    auto Invocation = new clang::CompilerInvocation;
+    initInvocation(*Invocation, pchHeader.c_str());
+    Invocation->getLangOpts()->Modules = true;
+    Clang.setInvocation(Invocation);
+    Clang.createDiagnostics(new clang::IgnoringDiagConsumer); // a map that fails to parse is simply skipped
+    Clang.setTarget(clang::TargetInfo::CreateTargetInfo(Clang.getDiagnostics(), Invocation->TargetOpts));
+    Clang.createFileManager();
+    Clang.createSourceManager(Clang.getFileManager());
+    Clang.createPreprocessor(clang::TU_Complete);
+
+    auto& HS = Clang.getPreprocessor().getHeaderSearchInfo();
+    auto& ModMap = HS.getModuleMap();
 
     for (unsigned i = 0; i < headers.dim; ++i)
-        fprintf(fheaderlist, "%s\n", headers[i]);
+    {
+        if (headers[i][0] == '<')
+            continue; // only the headers with absolute paths point to a known directory
 
-    fclose(fheaderlist);
+        auto Dir = path::parent_path(headers[i]);
+        if (!CheckedDirs.insert(Dir).second)
+            continue;
 
-    /* Mark every C++ module object file dirty */
+        std::error_code err;
+        fs::directory_iterator DirIt(Dir, err), DirEnd;
 
-    auto genListFilename = calypso.getCacheFilename(".gen");
-    llvm::sys::fs::remove(genListFilename, true);
-}
+        for (; DirIt != DirEnd && !err; DirIt.increment(err))
+        {
+            auto moduleMap = DirIt->path();
+            if (!path::extension(moduleMap).equals(".modulemap_d"))
+                continue;
 
-// WORKAROUND Temporary visitor to deserialize the entire ASTContext
-class ASTDummyVisitor : public clang::RecursiveASTVisitor<ASTDummyVisitor>
-{
-public:
-    bool shouldVisitTemplateInstantiations() const { return true; }
-};
+            auto MapFile = Clang.getFileManager().getFile(moduleMap);
+            if (!MapFile || HS.loadModuleMapFile(MapFile, false))
+                continue;
 
-void PCH::loadFromPCH()
+            // Top-level modules, skipping the extern ones which belong to another map
+            for (auto I = ModMap.module_begin(), E = ModMap.module_end(); I != E; ++I)
+            {
+                auto M = I->getValue();
+                if (ModMap.getContainingModuleMapFile(M) != MapFile)
+                    continue;
+
+                auto& name = M->Name;
+                if (!Names.insert(name).second)
+                    continue;
+
+                PrebuiltModule PM;
+                PM.name = name;
+                PM.moduleMap = moduleMap;
+                PM.moduleFile = calypso.getCacheFilename(("." + name + ".pcm").c_str());
+                Jobs.push_back(PM);
+            }
+        }
+    }
+
+    std::vector<bool> Built(Jobs.size(), false);
+
+#ifndef _WIN32
+    // Only the workers forked here get reaped, other children of the process (e.g tools run by the driver) are left
+    // alone. The oldest one is waited for first, the jobs are roughly as long as each other.
+    std::deque<std::pair<pid_t, size_t>> Workers;
+    size_t next = 0;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    while (next < Jobs.size() || !Workers.empty())
+    {
+        if (next < Jobs.size() && Workers.size() < opts::cppModuleJobs)
+        {
+            pid_t pid = fork();
+            if (pid == 0)
+                _exit(buildModule(Jobs[next]) ? 0 : 1);
+
+            if (pid < 0)
+                Built[next] = buildModule(Jobs[next]); // build it ourselves then
+            else
+                Workers.emplace_back(pid, next);
+            next++;
+            continue;
+        }
+
+        auto Worker = Workers.front();
+        Workers.pop_front();
+
+        int status;
+        pid_t pid;
+        do
+            pid = waitpid(Worker.first, &status, 0);
+        while (pid < 0 && errno == EINTR);
+
+        Built[Worker.second] = pid == Worker.first && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+#else
+    for (size_t i = 0; i < Jobs.size(); i++)
+        Built[i] = buildModule(Jobs[i]);
+#endif
+
+    for (size_t i = 0; i < Jobs.size(); i++)
+    {
+        if (Built[i])
+            prebuiltModules.push_back(Jobs[i]);
+        else
+            fs::remove(Jobs[i].moduleFile, true);
+    }
+}
+
+void PCH::loadFromHeaders()
+{
+//     llvm::sys::fs::remove(pchFilenameNew, true);
+
+    pchFilename = calypso.getCacheFilename(".h.pch"); // might have been pointing to a delta
+    parsedFromHeaders = true;
+    pchIdentity.clear();
+
+    // The module files of the previous PCH are out-of-date as well
+    for (auto& PM: prebuiltModules)
+        llvm::sys::fs::remove(PM.moduleFile, true);
+    prebuiltModules.clear();
+
+    writeMonoHeader(pchHeader.c_str());
+
+    if (opts::cppModuleJobs)
+        buildModules();
+
+    clang::CompilerInvocation CI;
+    initInvocation(CI, pchHeader.c_str());
+
+    // Parse the headers
+    DiagClient->muted = false;
+
+    llvm::IntrusiveRefCntPtr<clang::vfs::OverlayFileSystem> OverlayFileSystem(
+        new clang::vfs::OverlayFileSystem(clang::vfs::getRealFileSystem()));
+    auto Files = new clang::FileManager(clang::FileSystemOptions(), OverlayFileSystem);
+
+    PCHContainerOps.reset(new clang::PCHContainerOperations);
+
+    AST = ASTUnit::LoadFromCompilerInvocation(&CI, PCHContainerOps, Diags, Files, false, false, false,
+                                              clang::TU_Complete, false, false, false,
+                                              new InstantiationChecker).release();
+    AST->getSema();
+    Diags->getClient()->BeginSourceFile(AST->getLangOpts(), &AST->getPreprocessor());
+
+    needSaving = true;
+    DiagClient->muted = !opts::cppVerboseDiags;
+
+    /* The base PCH is going to be overwritten, so drop the deltas chained to it and the old manifest. The cache
+       lists only get published once the new PCH is, the other processes keep using the old ones until then. */
+
+    manifest.clear();
+    manifestArgs.clear();
+
+    obsoleteDeltas.append(&deltas);
+    deltas.setDim(0);
+}
+
+// Parse only the headers added since the last run on top of the cached PCH, the result will be saved as a chained PCH
+void PCH::loadDelta()
+{
+    auto suffix = ".delta" + llvm::utostr(deltas.dim + 1) + ".h";
+    auto deltaHeader = calypso.getCacheFilename(suffix.c_str());
+    auto deltaFilename = deltaHeader + ".pch";
+    parsedFromHeaders = false;
+    pchIdentity.clear(); // the decls it gets chained to will be ignored until the delta is reloaded
+
+    writeMonoHeader(deltaHeader.c_str(), cachedHeaders);
+
+    clang::CompilerInvocation CI;
+    initInvocation(CI, deltaHeader.c_str(), pchFilename.c_str());
+    if (validatedByManifest)
+        CI.getPreprocessorOpts().DisablePCHValidation = true;
+
+    // Parse the new headers
+    DiagClient->muted = false;
+
+    llvm::IntrusiveRefCntPtr<clang::vfs::OverlayFileSystem> OverlayFileSystem(
+        new clang::vfs::OverlayFileSystem(clang::vfs::getRealFileSystem()));
+    auto Files = new clang::FileManager(clang::FileSystemOptions(), OverlayFileSystem);
+
+    PCHContainerOps.reset(new clang::PCHContainerOperations);
+
+    DeltaWriter = new PCHDeltaWriter;
+
+    std::vector<std::unique_ptr<clang::ASTConsumer>> Consumers;
+    Consumers.push_back(std::unique_ptr<clang::ASTConsumer>(new InstantiationChecker));
+    Consumers.push_back(std::unique_ptr<clang::ASTConsumer>(DeltaWriter));
+
+    AST = ASTUnit::LoadFromCompilerInvocation(&CI, PCHContainerOps, Diags, Files, false, false, false,
+                                              clang::TU_Complete, false, false, false,
+                                              new clang::MultiplexConsumer(std::move(Consumers))).release();
+
+    DiagClient->muted = !opts::cppVerboseDiags;
+
+    if (!AST || Diags->hasFatalErrorOccurred())
+    {
+        // The cached PCH is most likely out-of-date, reparse everything
+        delete AST;
+        AST = nullptr;
+        DeltaWriter = nullptr;
+        Diags->Reset();
+
+        llvm::sys::fs::remove(deltaHeader, true);
+        loadFromHeaders();
+        return;
+    }
+
+    AST->getSema();
+    Diags->getClient()->BeginSourceFile(AST->getLangOpts(), &AST->getPreprocessor());
+
+    pchHeader = deltaHeader;
+    pchFilename = deltaFilename;
+    needSaving = true;
+}
+
+static void setDisablePCHValidationEnv(bool disable)
+{
+#if _WIN32
+    _putenv_s("LIBCLANG_DISABLE_PCH_VALIDATION", disable ? "1" : "");
+#else
+    if (disable)
+        setenv("LIBCLANG_DISABLE_PCH_VALIDATION", "1", 1);
+    else
+        unsetenv("LIBCLANG_DISABLE_PCH_VALIDATION");
+#endif
+}
+
+bool PCH::loadFromPCH()
 {
     clang::FileSystemOptions FileSystemOpts;
     clang::ASTReader::ASTReadResult ReadResult;
     
+    parsedFromHeaders = false;
     DiagClient->muted = false;
 
+    // If the PCH got replaced while being read, which one the decl IDs belong to is unknown
+    pchIdentity = getPCHIdentity(pchFilename);
+
     PCHContainerOps.reset(new clang::PCHContainerOperations);
     auto *Reader = PCHContainerOps->getReaderOrNull("raw");
 
+    // If the manifest already vouched for every input file, don't let the ASTReader stat them again
+    // NOTE: ASTUnit::LoadFromASTFile only offers to disable the validation through this environment variable
+    bool disableValidation = validatedByManifest && !getenv("LIBCLANG_DISABLE_PCH_VALIDATION");
+    if (disableValidation)
+        setDisablePCHValidationEnv(true);
+
     AST = ASTUnit::LoadFromASTFile(pchFilename, *Reader,
                             Diags, FileSystemOpts, false, false, llvm::None, false,
                             /* AllowPCHWithCompilerErrors = */ true, false,
                             new InstantiationChecker, &ReadResult).release();
 
+    if (disableValidation)
+        setDisablePCHValidationEnv(false);
+
+    if (pchIdentity != getPCHIdentity(pchFilename))
+        pchIdentity.clear();
+
     DiagClient->muted = !opts::cppVerboseDiags;
 
     switch (ReadResult) {
@@ -759,24 +1532,29 @@ void PCH::loadFromPCH()
         case clang::ASTReader::VersionMismatch:
         case clang::ASTReader::ConfigurationMismatch:
             delete AST;
+            AST = nullptr;
             Diags->Reset();
 
-            // Headers or flags may have changed since the PCH was generated, fall back to headers.
-            loadFromHeaders();
-            return;
+            // Headers or flags may have changed since the PCH was generated, the caller has to reparse the headers
+            return false;
 
         default:
             fatal();
-            return;
+            return false;
     }
 
     if (!AST)
         fatal();
 
-    // WORKAROUND for https://llvm.org/bugs/show_bug.cgi?id=24420
-    // « RecordDecl::LoadFieldsFromExternalStorage() expels existing decls from the DeclContext linked list »
-    // This only concerns serialized declarations, new records aren't affected by this issue
-    ASTDummyVisitor().TraverseDecl(AST->getASTContext().getTranslationUnitDecl());
+    // NOTE: the declarations are deserialized lazily, see InstantiationChecker::AddedCXXImplicitMember() for the
+    // workaround to PR24420
+    return true;
+}
+
+void PCH::preload()
+{
+    update();
+    preloaded = AST != nullptr;
 }
 
 void PCH::update()
@@ -784,6 +1562,31 @@ void PCH::update()
     if (headers.empty())
         return;
 
+    if (preloaded)
+    {
+        preloaded = false;
+
+        // The headers may have been edited since the server preloaded the PCH
+        bool dirty = !checkManifest();
+
+        // The preloaded PCH lacks the headers added since, or is out-of-date, but no decl was mapped from it yet so
+        // it can be discarded
+        if (needHeadersReload || dirty)
+        {
+            AST = nullptr; // NOTE: leaked, but this only happens in short-lived compile server children
+            delete MMap;
+            MMap = nullptr;
+            calypso.clearMacroMap();
+            for (auto& Cache: calypso.FromTypeCache)
+                Cache.clear();
+            calypso.NonMemberOperators.clear();
+        }
+
+        // Another compilation may have regenerated the PCH already
+        if (dirty)
+            reloadCacheLists();
+    }
+
     if (!needHeadersReload && AST)
         return;
 
@@ -802,7 +1605,10 @@ void PCH::update()
         }
 
         if (dirtyPCH && !exists(result))
+        {
             needHeadersReload = true;
+            cachedHeaders = 0;
+        }
 
         return fn_var;
     };
@@ -811,19 +1617,56 @@ void PCH::update()
     pchFilename = AddSuffixThenCheck(".h.pch");
 //     pchFilenameNew = AddSuffixThenCheck(".new.pch", false);
 
+    if (cachedHeaders && !deltas.empty())
+        pchFilename = deltas.back(); // the last delta chains to the previous ones and the base PCH
+
+    // Check up front whether a header changed since the PCH was generated, instead of having Clang find out lazily
+    if (cachedHeaders && !checkManifest())
+    {
+        needHeadersReload = true;
+        cachedHeaders = 0;
+    }
+
+    // Only one process regenerates the PCH of a cache directory at a time, the others wait for it to be published
+    // and then only parse the headers it's missing, if any
+    if (needHeadersReload && !CacheLock)
+    {
+        CacheLock.reset(new llvm::LockFileManager(calypso.getCacheFilename(".h.pch")));
+
+        switch (CacheLock->getState())
+        {
+            case llvm::LockFileManager::LFS_Owned:
+                break; // held until save() publishes the new PCH
+            case llvm::LockFileManager::LFS_Shared:
+                CacheLock->waitForUnlock();
+                CacheLock.reset();
+                reloadCacheLists();
+                return update();
+            case llvm::LockFileManager::LFS_Error:
+                CacheLock.reset(); // go on without, the cache files are still replaced atomically
+                break;
+        }
+    }
+
     if (needHeadersReload)
     {
-        // The PCH either doesn't exist or is obsolete, reparse the header files
-        loadFromHeaders();
+        if (cachedHeaders && cachedHeaders < headers.dim && deltas.dim < maxDeltas)
+            // New headers were added, only parse them on top of the cached PCH
+            loadDelta();
+        else
+            // The PCH either doesn't exist or is obsolete, reparse the header files
+            loadFromHeaders();
         needHeadersReload = false;
     }
-    else
+    else if (!loadFromPCH())
     {
-        // The PCH is up-to-date, use it
-        loadFromPCH();
+        // The PCH turned out to be out-of-date, regenerate it once the cache lock is held
+        needHeadersReload = true;
+        cachedHeaders = 0;
+        return update();
     }
 
-    /* Collect Clang module map files */
+    /* Collect Clang module map files and index the FileIDs of every header */
     auto& SrcMgr = AST->getSourceManager();
     auto& PP = AST->getPreprocessor();
 
@@ -831,6 +1674,8 @@ void PCH::update()
                             PP.getLangOpts(), &PP.getTargetInfo(), PP.getHeaderSearchInfo());
 
     llvm::DenseSet<const clang::DirectoryEntry*> CheckedDirs;
+    uint64_t moduleMapsTime = 0;
+    FileIDs.clear();
     auto lookForModuleMap = [&] (const clang::SrcMgr::SLocEntry& SLoc) {
         if (SLoc.isExpansion())
             return;
@@ -839,6 +1684,9 @@ void PCH::update()
         if (!OrigEntry)
             return;
 
+        auto Loc = clang::SourceLocation::getFromRawEncoding(SLoc.getOffset());
+        FileIDs[OrigEntry].push_back(SrcMgr.getFileID(Loc)); // NOTE: getting a FileID without a SourceLocation is impossible, it's locked tight
+
         auto Dir = OrigEntry->getDir();
 
         if (CheckedDirs.count(Dir))
@@ -857,6 +1705,7 @@ void PCH::update()
             {
                 auto MMapFile = AST->getFileManager().getFile(path);
                 assert(MMapFile);
+                moduleMapsTime = std::max(moduleMapsTime, (uint64_t) MMapFile->getModificationTime());
 
                 if (MMap->parseModuleMapFile(MMapFile, false, Dir))
                 {
@@ -887,11 +1736,17 @@ void PCH::update()
         return update();
     }
 
+    // The decl IDs of the previous PCH are meaningless for the one about to be saved
+    if (needSaving)
+        llvm::sys::fs::remove(calypso.getCacheFilename(".decls"), true);
+    readModuleDecls(moduleMapsTime);
+
     // Build the builtin type map
     calypso.builtinTypes.build(AST->getASTContext());
 
-    // Since macros aren't sorted by file (unlike decls) we build a map of macros in order to only go through every macro once
-    calypso.buildMacroMap();
+    // Since macros aren't sorted by file (unlike decls) a map of macros gets built in order to only go through every
+    // macro once, but only when the first module maps its macros
+    calypso.clearMacroMap();
 
     // Initialize the mangling context
     MangleCtx = AST->getASTContext().createMangleContext();
@@ -899,11 +1754,11 @@ void PCH::update()
 
 void LangPlugin::buildMacroMap()
 {
-    auto& MMap = pch.MMap;
     auto& PP = getPreprocessor();
-    auto& Sema = getSema();
     auto& SM = getSourceManager();
 
+    macroMapBuilt = true;
+
     for (auto I = PP.macro_begin(), E = PP.macro_end(); I != E; I++)
     {
         auto II = (*I).getFirst();
@@ -920,49 +1775,102 @@ void LangPlugin::buildMacroMap()
         if (Tok.getKind() != clang::tok::numeric_constant)
             continue;
 
-        // Find the corresponding module header this macro is from
-        auto MLoc = MDir->getLocation();
-        auto MFileID = SM.getFileID(MLoc);
+        // Group it with the other macros of the header it's from
+        auto MFileID = SM.getFileID(MDir->getLocation());
         auto MFileEntry = SM.getFileEntryForID(MFileID);
+        if (!MFileEntry)
+            continue;
 
-        const clang::Module::Header *FoundHeader = nullptr;
-        for (auto ModI = MMap->module_begin(), ModE = MMap->module_end(); ModI != ModE; ModI++) {
-            for (auto& Header: ModI->getValue()->Headers[clang::Module::HK_Normal])
-                if (MFileEntry == Header.Entry) {
-                    FoundHeader = &Header; break;
-                }
-            if (FoundHeader) break;
-        }
+        PendingMacros[MFileEntry].emplace_back(II, MInfo);
+    }
+}
 
-        if (!FoundHeader)
-            continue;
+void LangPlugin::clearMacroMap()
+{
+    MacroMap.clear();
+    PendingMacros.clear();
+    macroMapBuilt = false;
+}
+
+LangPlugin::MacroMapEntryTy *LangPlugin::getHeaderMacros(const clang::Module::Header &Header)
+{
+    if (!macroMapBuilt)
+        buildMacroMap();
 
-        auto& MacroMapEntry = MacroMap[FoundHeader];
-        if (!MacroMapEntry)
-            MacroMapEntry = new MacroMapEntryTy;
+    auto& MacroMapEntry = MacroMap[Header.Entry];
+    if (MacroMapEntry)
+        return MacroMapEntry;
 
-        auto ResultExpr = Sema.ActOnNumericConstant(Tok);
-        assert(!ResultExpr.isInvalid());
-        auto Expr = ResultExpr.get();
+    auto Pending = PendingMacros.find(Header.Entry);
+    if (Pending == PendingMacros.end())
+        return nullptr;
+
+    auto& Sema = getSema();
 
-        MacroMapEntry->emplace_back(II, Expr);
+    MacroMapEntry = new MacroMapEntryTy;
+    for (auto& P: Pending->second)
+    {
+        auto ResultExpr = Sema.ActOnNumericConstant(P.second->getReplacementToken(0));
+        assert(!ResultExpr.isInvalid());
+        MacroMapEntry->emplace_back(P.first, ResultExpr.get());
     }
+
+    PendingMacros.erase(Pending);
+    return MacroMapEntry;
 }
 
 void PCH::save()
 {
+    // The .decls and .gen cache files are append-only, drop their obsolete lines
+    if (moduleDeclsStale)
+        writeModuleDecls();
+    calypso.genModSet.compact();
+
     if (!needSaving)
         return;
 
-    if (AST->getASTContext().getExternalSource() != nullptr) // FIXME: Clang makes it hard to save a new PCH when an external source like another PCH is loaded by the ASTContext
+    auto& PP = AST->getPreprocessor();
+    auto& Sysroot = PP.getHeaderSearchInfo().getHeaderSearchOpts().Sysroot;
+
+    if (DeltaWriter)
+    {
+        // Write the chained PCH, i.e only what was added since the cached PCH was loaded
+        DeltaWriter->Writer.WriteAST(AST->getSema(), pchFilename, nullptr, Sysroot,
+                                     AST->getDiagnostics().hasErrorOccurred());
+
+        auto tmpFilename = createTempCacheFile(pchFilename);
+        {
+            std::error_code EC;
+            llvm::raw_fd_ostream OS(tmpFilename, EC, llvm::sys::fs::F_None);
+            OS.write(DeltaWriter->Buffer.data(), DeltaWriter->Buffer.size());
+        }
+        publishCacheFile(tmpFilename, pchFilename);
+
+        DeltaWriter = nullptr; // the writer can't be used twice, instantiations done by the next modules won't be saved
+        needSaving = false;
+
+        /* Update the list of headers and deltas now that the delta PCH exists */
+
+        deltas.push(strdup(pchFilename.c_str()));
+        updateManifest();
+        writeCacheLists();
+        cachedHeaders = headers.dim;
+
+        CacheLock.reset(); // the other processes may use the new PCH now
         return;
+    }
 
-    auto& PP = AST->getPreprocessor();
+    // The only external source of an AST parsed from the headers is the module files built by -cpp-module-jobs,
+    // which the new PCH imports.
+    if (!parsedFromHeaders) // FIXME: Clang makes it hard to save a new PCH when another PCH is loaded as external source by the ASTContext
+    {
+        CacheLock.reset();
+        return;
+    }
 
+    auto tmpFilename = createTempCacheFile(pchFilename);
     std::error_code EC;
-    llvm::raw_fd_ostream OS(pchFilename, EC, llvm::sys::fs::F_None);
-
-    auto& Sysroot = PP.getHeaderSearchInfo().getHeaderSearchOpts().Sysroot;
+    llvm::raw_fd_ostream OS(tmpFilename, EC, llvm::sys::fs::F_None);
     auto Buffer = std::make_shared<clang::PCHBuffer>();
     auto *Writer = PCHContainerOps->getWriterOrNull("raw");
 
@@ -972,6 +1880,11 @@ void PCH::save()
                                           true);
     GenPCH->InitializeSema(AST->getSema());
 
+    // The PCH was loaded before the generator existed, so the writer has to be told about the reader of the module
+    // files to reference their decls instead of writing them again
+    if (auto Source = AST->getASTContext().getExternalSource())
+        GenPCH->GetASTDeserializationListener()->ReaderInitialized(static_cast<clang::ASTReader*>(Source));
+
     std::vector<std::unique_ptr<clang::ASTConsumer>> Consumers;
     Consumers.push_back(std::unique_ptr<clang::ASTConsumer>(GenPCH));
     Consumers.push_back(Writer->CreatePCHContainerGenerator(
@@ -980,9 +1893,334 @@ void PCH::save()
     auto Mutiplex = llvm::make_unique<clang::MultiplexConsumer>(std::move(Consumers));
     Mutiplex->HandleTranslationUnit(AST->getASTContext());
 
+    OS.close();
+    publishCacheFile(tmpFilename, pchFilename);
+
     needSaving = false;
+
+    /* Update the lists now that the new PCH exists, and only then remove the deltas chained to the old one */
+
+    updateManifest();
+    writeCacheLists();
+    cachedHeaders = headers.dim;
+
+    for (unsigned i = 0; i < obsoleteDeltas.dim; ++i)
+        llvm::sys::fs::remove(obsoleteDeltas[i], true);
+    obsoleteDeltas.setDim(0);
+
+    CacheLock.reset(); // the other processes may use the new PCH now
+}
+
+namespace
+{
+// Hashes what the object file of a C++ module gets generated from: the source text and the layout of the mapped decls,
+// and the definitions of the functions they reach that may end up emitted in the module (inline functions and
+// template instances), along with the decls, types and macros these definitions refer to
+class CodegenKeyHasher : public clang::RecursiveASTVisitor<CodegenKeyHasher>
+{
+    clang::ASTContext &Context;
+    clang::SourceManager &SrcMgr;
+    clang::Preprocessor &PP;
+    llvm::MD5 Hash;
+    llvm::DenseSet<const clang::Decl*> Hashed;
+    llvm::DenseSet<const clang::Type*> HashedTypes;
+    llvm::DenseSet<const clang::IdentifierInfo*> HashedMacros;
+
+    void hashInt(uint64_t Value)
+    {
+        Hash.update(llvm::StringRef(reinterpret_cast<const char*>(&Value), sizeof(Value)));
+    }
+
+    void hashString(llvm::StringRef Str)
+    {
+        Hash.update(Str);
+        Hash.update(llvm::StringRef("\0", 1));
+    }
+
+    void hashName(const clang::NamedDecl *ND)
+    {
+        std::string Name;
+        llvm::raw_string_ostream OS(Name);
+        ND->getNameForDiagnostic(OS, Context.getPrintingPolicy(), /*Qualified=*/true);
+        if (auto VD = dyn_cast<clang::ValueDecl>(ND))
+            OS << " " << VD->getType().getCanonicalType().getAsString(); // typedefs may be retargeted
+        hashString(OS.str());
+    }
+
+    // The text doesn't change when a macro used in it gets redefined
+    void hashMacro(const clang::IdentifierInfo *II)
+    {
+        if (!II || !II->hasMacroDefinition() || !HashedMacros.insert(II).second)
+            return;
+
+        auto MI = PP.getMacroInfo(II);
+        if (!MI)
+            return;
+
+        hashString(II->getName());
+        hashInt(MI->isFunctionLike());
+        for (auto I = MI->arg_begin(), E = MI->arg_end(); I != E; ++I)
+            hashString((*I)->getName());
+        for (auto I = MI->tokens_begin(), E = MI->tokens_end(); I != E; ++I)
+        {
+            hashString(PP.getSpelling(*I));
+            if (I->getIdentifierInfo())
+                hashMacro(I->getIdentifierInfo());
+        }
+    }
+
+    void hashMacrosIn(llvm::StringRef Text, clang::SourceLocation Loc)
+    {
+        std::string Buffer = Text; // the lexer expects a null-terminated buffer
+        clang::Lexer RawLex(Loc, Context.getLangOpts(), Buffer.data(), Buffer.data(), Buffer.data() + Buffer.size());
+
+        clang::Token Tok;
+        do
+        {
+            RawLex.LexFromRawLexer(Tok);
+            if (Tok.is(clang::tok::raw_identifier))
+                hashMacro(PP.getIdentifierInfo(Tok.getRawIdentifier()));
+        } while (Tok.isNot(clang::tok::eof));
+    }
+
+    void hashSourceText(const clang::Decl *D)
+    {
+        auto Range = D->getSourceRange();
+        if (Range.isInvalid())
+            return;
+
+        auto Begin = SrcMgr.getExpansionLoc(Range.getBegin());
+        auto End = SrcMgr.getExpansionRange(Range.getEnd()).second;
+        End = End.getLocWithOffset(clang::Lexer::MeasureTokenLength(End, SrcMgr, Context.getLangOpts()));
+
+        auto BeginInfo = SrcMgr.getDecomposedLoc(Begin),
+                EndInfo = SrcMgr.getDecomposedLoc(End);
+        if (BeginInfo.first != EndInfo.first || BeginInfo.second > EndInfo.second)
+            return;
+
+        bool Invalid = false;
+        auto Buffer = SrcMgr.getBufferData(BeginInfo.first, &Invalid);
+        if (Invalid)
+            return;
+
+        auto Text = Buffer.substr(BeginInfo.second, EndInfo.second - BeginInfo.second);
+        hashString(Text);
+        hashMacrosIn(Text, Begin);
+    }
+
+    void hashRecordLayout(const clang::RecordDecl *RD)
+    {
+        RD = RD->getDefinition();
+        if (!RD || RD->isInvalidDecl() || RD->isDependentType())
+            return;
+
+        auto& Layout = Context.getASTRecordLayout(RD);
+        hashInt(Layout.getSize().getQuantity());
+        hashInt(Layout.getAlignment().getQuantity());
+        for (unsigned i = 0; i < Layout.getFieldCount(); i++)
+            hashInt(Layout.getFieldOffset(i));
+
+        for (auto Field: RD->fields())
+            hashType(Field->getType());
+        if (auto CRD = dyn_cast<clang::CXXRecordDecl>(RD))
+            for (auto& Base: CRD->bases())
+                hashType(Base.getType());
+    }
+
+    // The records a type refers to, the code accessing them depends on their layout
+    void hashType(clang::QualType T)
+    {
+        if (T.isNull())
+            return;
+
+        T = T.getCanonicalType();
+        auto Ty = T.getTypePtr();
+        if (!HashedTypes.insert(Ty).second)
+            return;
+
+        hashString(T.getAsString());
+
+        if (auto RD = Ty->getAsRecordDecl())
+            hashRecordLayout(RD);
+        else if (auto FT = dyn_cast<clang::FunctionProtoType>(Ty))
+        {
+            hashType(FT->getReturnType());
+            for (auto ParamTy: FT->param_types())
+                hashType(ParamTy);
+        }
+        else if (auto AT = Context.getAsArrayType(T))
+            hashType(AT->getElementType());
+        else if (!Ty->getPointeeType().isNull()) // pointers, references and member pointers
+            hashType(Ty->getPointeeType());
+    }
+
+public:
+    CodegenKeyHasher()
+        : Context(calypso.getASTContext()), SrcMgr(calypso.getSourceManager()), PP(calypso.getPreprocessor()) {}
+
+    void hashDecl(const clang::Decl *D)
+    {
+        if (!D || !Hashed.insert(D).second)
+            return;
+
+        if (auto ND = dyn_cast<clang::NamedDecl>(D))
+            hashName(ND);
+        if (auto VD = dyn_cast<clang::ValueDecl>(D))
+            hashType(VD->getType()); // the signature of functions as well
+        hashSourceText(D);
+
+        if (auto RD = dyn_cast<clang::RecordDecl>(D))
+        {
+            hashRecordLayout(RD);
+            if (auto CRD = dyn_cast<clang::CXXRecordDecl>(RD))
+                if (auto Def = CRD->getDefinition())
+                    for (auto MD: Def->methods())
+                        hashDecl(MD);
+        }
+        else if (auto FD = dyn_cast<clang::FunctionDecl>(D))
+        {
+            const clang::FunctionDecl *Def;
+            if (!FD->hasBody(Def))
+                return;
+
+            if (Def != FD)
+                hashSourceText(Def); // out-of-line definition
+
+            // Only the functions which may get emitted alongside this module are relevant, the other ones only
+            // need a stable signature
+            if (Def->isInlined() || !Def->hasExternalFormalLinkage() ||
+                    Def->getTemplatedKind() != clang::FunctionDecl::TK_NonTemplate)
+                TraverseStmt(Def->getBody());
+
+            if (auto CD = dyn_cast<clang::CXXConstructorDecl>(Def))
+                for (auto Init: CD->inits())
+                    TraverseStmt(Init->getInit());
+        }
+        else if (auto VD = dyn_cast<clang::VarDecl>(D))
+        {
+            if (auto Def = VD->getDefinition())
+                if (Def != VD)
+                    hashSourceText(Def);
+
+            // Constants get folded into the code using them
+            if (auto Init = VD->getAnyInitializer())
+                TraverseStmt(const_cast<clang::Expr*>(Init));
+        }
+        else if (auto ECD = dyn_cast<clang::EnumConstantDecl>(D))
+        {
+            hashString(ECD->getInitVal().toString(10));
+            if (auto Init = ECD->getInitExpr())
+                TraverseStmt(const_cast<clang::Expr*>(Init));
+        }
+    }
+
+    void hashSymbols(Dsymbols *members)
+    {
+        if (!members)
+            return;
+
+        for (auto s: *members)
+        {
+            if (auto ti = s->isTemplateInstance())
+            {
+                hashString(ti->toChars());
+                hashSymbols(ti->members);
+                continue;
+            }
+
+            if (auto attrib = s->isAttribDeclaration())
+            {
+                hashSymbols(attrib->decl);
+                continue;
+            }
+
+            if (!isCPP(s))
+                continue;
+
+            if (auto ad = s->isAggregateDeclaration())
+                hashDecl(getRecordDecl(ad));
+            else if (s->isFuncDeclaration() || s->isVarDeclaration() || s->isEnumDeclaration())
+                hashDecl(getDecl(s));
+        }
+    }
+
+    bool VisitCallExpr(const clang::CallExpr *E)
+    {
+        hashDecl(E->getDirectCallee());
+        return true;
+    }
+
+    bool VisitCXXConstructExpr(const clang::CXXConstructExpr *E)
+    {
+        hashDecl(E->getConstructor());
+        return true;
+    }
+
+    bool VisitCXXNewExpr(const clang::CXXNewExpr *E)
+    {
+        hashDecl(E->getOperatorNew());
+        hashDecl(E->getOperatorDelete());
+        return true;
+    }
+
+    bool VisitCXXDeleteExpr(const clang::CXXDeleteExpr *E)
+    {
+        hashDecl(E->getOperatorDelete());
+        return true;
+    }
+
+    bool VisitDeclRefExpr(const clang::DeclRefExpr *E)
+    {
+        hashDecl(E->getDecl()); // functions, variables and enumerators
+        return true;
+    }
+
+    bool VisitMemberExpr(const clang::MemberExpr *E)
+    {
+        hashDecl(E->getMemberDecl());
+        return true;
+    }
+
+    bool VisitExpr(const clang::Expr *E)
+    {
+        hashType(E->getType());
+        return true;
+    }
+
+    bool VisitValueDecl(const clang::ValueDecl *D)
+    {
+        hashType(D->getType()); // locals and parameters
+        return true;
+    }
+
+    std::string result()
+    {
+        hashString(hashCppArgs());
+        hashInt(global.params.symdebug);
+        hashInt(opts::cppDedupInstances);
+
+        llvm::MD5::MD5Result Result;
+        Hash.final(Result);
+
+        llvm::SmallString<32> Str;
+        llvm::MD5::stringifyResult(Result, Str);
+        return Str.str();
+    }
+};
+}
+
+// The key of a C++ module object file changes whenever one of the decls it was mapped from, or one of the template
+// instances it emits, changes. The PCH may get rebuilt without invalidating it.
+std::string LangPlugin::codegenKey(::Module *m)
+{
+    assert(isCPP(m));
+
+    CodegenKeyHasher Hasher;
+    Hasher.hashSymbols(m->members);
+    return Hasher.result();
 }
 
+// Each line of the .gen file is "<object file> <key>", later lines take precedence
 void LangPlugin::GenModSet::parse()
 {
     if (parsed)
@@ -995,31 +2233,76 @@ void LangPlugin::GenModSet::parse()
     if (!llvm::sys::fs::exists(genFilename))
         return;
 
-    auto fgenList = fopen(genFilename.c_str(), "r"); // ordered list of headers
+    auto fgenList = fopen(genFilename.c_str(), "r");
     if (!fgenList)
     {
         ::error(Loc(), "Reading .gen file failed");
         fatal();
     }
 
+    unsigned numLines = 0;
     char linebuf[MAX_FILENAME_SIZE];
     while (fgets(linebuf, sizeof(linebuf), fgenList) != NULL)
     {
         linebuf[strcspn(linebuf, "\n")] = '\0';
         if (linebuf[0] == '\0')
             continue;
+        numLines++;
 
-        if (llvm::sys::fs::exists(linebuf))
-            insert(strdup(linebuf));
+        llvm::StringRef objName, key;
+        std::tie(objName, key) = llvm::StringRef(linebuf).rsplit(' ');
+        if (key.empty())
+            continue; // written by an older version, regenerate the object file
+
+        if (llvm::sys::fs::exists(objName))
+            (*this)[objName] = key;
     }
 
     fclose(fgenList);
+
+    // Overridden keys and deleted object files
+    stale = numLines > size();
+}
+
+// Rewrite the .gen file with only the current key of each object file
+void LangPlugin::GenModSet::compact()
+{
+    if (!stale)
+        return;
+
+    // Re-read it first to keep the lines appended by other processes in the meantime
+    parsed = false;
+    parse();
+
+    auto genFilename = calypso.getCacheFilename(".gen");
+    auto tmpFilename = createTempCacheFile(genFilename);
+    auto fgenList = fopen(tmpFilename.c_str(), "w");
+    if (!fgenList)
+    {
+        ::error(Loc(), "Writing .gen file failed");
+        fatal();
+    }
+
+    for (auto& Entry: *this)
+        fprintf(fgenList, "%s %s\n", Entry.getKey().str().c_str(), Entry.getValue().c_str());
+
+    fclose(fgenList);
+    publishCacheFile(tmpFilename, genFilename);
+
+    stale = false;
 }
 
 void LangPlugin::GenModSet::add(::Module *m)
 {
     auto& objName = m->objfile->name->str;
-    assert(parsed && !count(objName));
+    auto& key = static_cast<cpp::Module*>(m)->codegenKey;
+    if (key.empty()) // needsCodegen wasn't called, e.g with -singleobj
+        key = calypso.codegenKey(m);
+
+    parse();
+
+    std::string line = objName;
+    line += " " + key + "\n";
 
     auto genFilename = calypso.getCacheFilename(".gen");
     auto fgenList = fopen(genFilename.c_str(), "a");
@@ -1029,10 +2312,12 @@ void LangPlugin::GenModSet::add(::Module *m)
         fatal();
     }
 
-    fprintf(fgenList, "%s\n", objName);
+    // Unbuffered so that the line gets appended by a single write, other processes may be appending to the file too
+    setvbuf(fgenList, nullptr, _IONBF, 0);
+    fwrite(line.data(), 1, line.size(), fgenList);
     fclose(fgenList);
 
-    insert(objName);
+    (*this)[objName] = key;
 }
 
 bool LangPlugin::needsCodegen(::Module *m)
@@ -1041,8 +2326,12 @@ bool LangPlugin::needsCodegen(::Module *m)
 
     genModSet.parse();
 
+    auto& key = static_cast<cpp::Module*>(m)->codegenKey;
+    key = codegenKey(m);
+
     auto& objName = m->objfile->name->str;
-    return !genModSet.count(objName);
+    auto I = genModSet.find(objName);
+    return I == genModSet.end() || I->second != key;
 }
 
 #undef MAX_FILENAME_SIZE
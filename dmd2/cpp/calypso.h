@@ -12,8 +12,11 @@
 #include "../gen/cgforeign.h"
 
 #include <memory>
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringSet.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/Support/LockFileManager.h"
 #include "clang/AST/ASTMutationListener.h"
 #include "clang/Basic/SourceLocation.h"
 #include "clang/Sema/DeclSpec.h"
@@ -31,6 +34,8 @@ class IdentifierInfo;
 class CodeGenFunction;
 class Sema;
 class ASTUnit;
+class CompilerInvocation;
+class FileEntry;
 class MacroInfo;
 class ModuleMap;
 class PCHContainerOperations;
@@ -39,6 +44,7 @@ class PCHContainerOperations;
 namespace cpp
 {
 
+class Module;
 class ClassDeclaration;
 class BuiltinTypes;
 class TemplateInstance;
@@ -86,6 +92,16 @@ public:
 
     void CompletedImplicitDefinition(const clang::FunctionDecl *D) override;
     void FunctionDefinitionInstantiated(const clang::FunctionDecl *D) override;
+    void AddedCXXImplicitMember(const clang::CXXRecordDecl *RD, const clang::Decl *D) override;
+
+    // Between these the checks are done once at the end of the batch instead of after each definition
+    static void beginBatch();
+    static void endBatch();
+
+private:
+    static unsigned batchDepth;
+    static bool batchInstantiated;
+    static void check();
 };
 
 class DiagMuter
@@ -95,37 +111,138 @@ public:
    ~DiagMuter();
 };
 
+class PCHDeltaWriter;
+
 class PCH
 {
 public:
     Strings headers; // array of all C/C++ header names with the "" or <>, required as long as we're using a PCH
-            // the array is initialized at the first Modmap::semantic and kept in sync with a cache file named 'calypso_cache.list'
+            // the array is initialized at the first Modmap::semantic and kept in sync with the cache list file named 'calypso_cache'
             // TODO: it's currently pretty basic and dumb and doesn't check whether the same header might be named differently or is already included by another
+    unsigned cachedHeaders = 0; // number of headers already contained in the cached PCH chain
+    Strings deltas; // chained PCHs layered over the base PCH, each one only containing the headers added since the previous one
+            // kept in sync with the cache list file
+    Strings obsoleteDeltas; // chained to the base PCH being regenerated, removed once the new one is saved
     bool needHeadersReload = false;
+
+    struct ManifestEntry
+    {
+        uint64_t mtime = 0;
+        uint64_t size = 0;
+        std::string hash; // MD5 of the file contents
+    };
+    llvm::StringMap<ManifestEntry> manifest; // every file the PCH depends on, kept in sync with the cache list file
+    std::string manifestArgs; // hash of the -cpp-args the PCH was generated with
+    bool validatedByManifest = false; // if true Clang doesn't need to check the PCH input files again
+
     ASTUnit *AST = nullptr;
     clang::MangleContext *MangleCtx = nullptr;
 
+    // A header may be entered several times, and SourceManager::translateFile() only returns its first FileID, which
+    // doesn't contain all the decls. So every FileID of each header is indexed once the PCH is loaded.
+    llvm::DenseMap<const clang::FileEntry*, llvm::SmallVector<clang::FileID, 1>> FileIDs;
+
     DiagnosticPrinter *DiagClient;
     clang::IntrusiveRefCntPtr<clang::DiagnosticsEngine> Diags;
     std::shared_ptr<clang::PCHContainerOperations> PCHContainerOps;
     
     ModuleMap *MMap = nullptr;
 
-    void init(); // load the list of headers already cached in the PCH
+    // IDs of the top-level decls found by the last scan of each namespace or Clang module, kept in sync with a cache
+    // file named 'calypso_cache.decls'. Decl IDs only hold for the PCH they were read from, so the file starts with
+    // the identity of that PCH and gets ignored by the processes which loaded another one.
+    llvm::StringMap<std::vector<uint32_t>> moduleDecls;
+    bool moduleDeclsStale = false; // true if the file has obsolete lines
+    bool moduleDeclsIgnored = false; // true if the file wasn't written for this PCH, or is older than a module map
+    std::string pchIdentity; // of the PCH file loaded by loadFromPCH(), empty if the headers were parsed
+    bool ownsModuleDecls();
+    bool lookupModuleDecls(llvm::StringRef moduleName, llvm::SmallVectorImpl<const clang::Decl*> &Decls);
+    void cacheModuleDecls(llvm::StringRef moduleName, llvm::ArrayRef<const clang::Decl*> Decls);
+
+    void init(); // load the list of headers already cached in the PCH, along with the other cache lists
     void add(const char* header, ::Module *from);
 
     void update(); // re-emit the PCH if needed, and update the cached list
+    void preload(); // load the cached PCH before any C++ module gets imported, used by the compile server
+    bool preloaded = false; // true until the first update() after preload()
 
     bool needSaving = false;
+    bool parsedFromHeaders = false; // i.e not loaded from the cached PCH, which save() can only write deltas to
     void save();
 
+    // Clang modules built in parallel before the headers get parsed (-cpp-module-jobs), which the PCH imports
+    // instead of parsing their headers again. Kept in sync with the cache list file.
+    struct PrebuiltModule
+    {
+        std::string name;
+        std::string moduleMap;
+        std::string moduleFile;
+    };
+    std::vector<PrebuiltModule> prebuiltModules;
+
     std::string pchHeader;
     std::string pchFilename;
 //     std::string pchFilenameNew; // the PCH may be updated by Calypso, but into a different file since the original PCH is still opened as external source for the ASTContext
 
 protected:
+    static const unsigned maxDeltas = 8; // past this number of deltas the headers get reparsed into a single PCH again
+
+    PCHDeltaWriter *DeltaWriter = nullptr; // non-null if the headers added since the last run were parsed on top of the cached PCH
+
+    std::unique_ptr<llvm::LockFileManager> CacheLock; // owned while this process regenerates the PCH of the cache directory
+
+    void readCacheLists();
+    void writeCacheLists(); // publish the headers, deltas, modules and manifest together
+    void reloadCacheLists();
+
+    void initInvocation(clang::CompilerInvocation &CI, const char *header, const char *includePCH = nullptr);
+    void writeMonoHeader(const char *filename, unsigned firstHeader = 0);
+
+    void readModuleDecls(uint64_t moduleMapsTime); // the cache is ignored if a module map is more recent
+    void writeModuleDecls();
+
+    bool buildModule(const PrebuiltModule &PM);
+    void buildModules();
+
+    bool checkManifest(); // returns false if a header or the arguments changed since the PCH was generated
+    void updateManifest(); // merge the files the PCH depends on into the manifest
+
     void loadFromHeaders();
-    void loadFromPCH();
+    void loadDelta();
+    bool loadFromPCH(); // returns false if the PCH is out-of-date
+};
+
+// State of the C++ codegen kept for the whole compilation (i.e per LLVM context). The CodeGenModule of the current LLVM
+// module only gets created the first time it's needed, so modules that don't touch any C++ declaration skip its
+// construction and Release(), and the CodeGenTypes caches are carried over from one CodeGenModule to the next.
+class CodeGenSession
+{
+public:
+    void retarget(llvm::Module *lm); // set the LLVM module the next CodeGenModule will emit into
+    void release(); // save the CodeGenTypes state and destroy the CodeGenModule
+
+    explicit operator bool() const { return CGM != nullptr; }
+    clangCG::CodeGenModule *get() { if (!CGM) create(); return CGM.get(); }
+    clangCG::CodeGenModule *operator->() { return get(); }
+    clangCG::CodeGenModule &operator*() { return *get(); }
+
+    // Functions InternalDeclEmitter already went through for the current CodeGenModule, shared by all the call sites
+    llvm::DenseSet<const clang::Decl*> InternalDeclsVisited;
+
+    // Arranged calls to each C++ function, CGFunctionInfos belong to the CodeGenTypes of the current CodeGenModule
+    llvm::DenseMap<::FuncDeclaration*, const clangCG::CGFunctionInfo*> CallFunctionInfos;
+
+private:
+    void create();
+
+    std::unique_ptr<clangCG::CodeGenModule> CGM;
+    std::unique_ptr<clang::CodeGenOptions> Opts;
+    llvm::Module *TargetModule = nullptr;
+
+    // Keep the existing LLVM types generated by CodeGenTypes between modules
+    llvm::DenseMap<const clang::Type*, clangCG::CGRecordLayout*> CGRecordLayouts;
+    llvm::DenseMap<const clang::Type*, llvm::StructType*> RecordDeclTypes;
+    llvm::DenseMap<const clang::Type *, llvm::Type*> TypeCache;
 };
 
 class LangPlugin : public ::LangPlugin, public ::ForeignCodeGen
@@ -166,11 +283,12 @@ public:
     ForeignCodeGen *codegen() override { return this; }
     bool needsCodegen(::Module *m) override;
 
-    std::stack<clangCG::CodeGenFunction *> CGFStack;
-    inline clangCG::CodeGenFunction *CGF() { return CGFStack.top(); }
+    std::stack<std::pair<clangCG::CodeGenFunction *, llvm::Instruction *>> CGFStack; // created lazily from the function alloca point
+    clangCG::CodeGenFunction *CGF();
 
     void enterModule(::Module *m, llvm::Module *) override;
     void leaveModule(::Module *m, llvm::Module *) override;
+    void finishCodegen() override;
 
     void enterFunc(::FuncDeclaration *fd) override;
     void leaveFunc() override;
@@ -215,40 +333,76 @@ public:
     llvm::Constant *toCatchScopeType(IRState *irs, Type *t) override;
 
     void EmitInternalDeclsForFields(const clang::RecordDecl *RD);
+
+    // ABI information about the calls to a C++ function which only needs to be derived once per compilation
+    struct CallInfo
+    {
+        bool hasArgTypes = false;
+        llvm::SmallVector<clang::QualType, 4> ArgTypes; // Clang types of the D parameters
+        int ReturnInArg = -1; // -1 until toIsReturnInArg() is first called
+    };
+    llvm::DenseMap<::FuncDeclaration*, CallInfo> CallInfos;
          
     // ==== ==== ====
     PCH pch;
     llvm::MapVector<const clang::Decl*, std::string> MangledDeclNames;
 
+    // Numeric macros grouped by the header defining them, in a single pass over the macros the first time a module
+    // asks for them. Their expressions only get built for the headers whose macros are actually mapped.
     typedef std::vector<std::pair<const clang::IdentifierInfo*, clang::Expr*>> MacroMapEntryTy;
-    llvm::DenseMap<const clang::Module::Header*, MacroMapEntryTy*> MacroMap;
+    typedef std::vector<std::pair<const clang::IdentifierInfo*, const clang::MacroInfo*>> PendingMacrosTy;
+    llvm::DenseMap<const clang::FileEntry*, MacroMapEntryTy*> MacroMap;
+    llvm::DenseMap<const clang::FileEntry*, PendingMacrosTy> PendingMacros;
+    bool macroMapBuilt = false;
 
     BuiltinTypes &builtinTypes;
     DeclReferencer &declReferencer;
 
+    // Clang -> D type mappings by TypeMappers without any scope-dependent state, keyed by the opaque QualType and
+    // the module being mapped, and indexed by TypeMapper::cppPrefix. Only syntax copies of the cached types are handed out.
+    llvm::DenseMap<std::pair<void*, Module*>, Type*> FromTypeCache[2];
+
+    // Non-member overloaded operators of a lookup context bucketed by the canonical tag decl they take as operand,
+    // built in one pass the first time a record or enum from that context gets imported
+    typedef llvm::DenseMap<const clang::Decl*, llvm::SmallVector<clang::NamedDecl*, 4>> NonMemberOperatorsTy;
+    llvm::DenseMap<const clang::DeclContext*, NonMemberOperatorsTy> NonMemberOperators;
+
     ::ClassDeclaration *type_info_ptr; // wrapper around std::type_info for EH
     std::map<llvm::Constant*, llvm::GlobalVariable*> type_infoWrappers; // FIXME put into module state with the CodeGenModule
 
     std::string executablePath; // from argv[0] to locate Clang builtin headers
 
-    struct GenModSet : public llvm::StringSet<> // already compiled modules
+    struct GenModSet : public llvm::StringMap<std::string> // already compiled modules and their codegen key
     {
         bool parsed = false;
+        bool stale = false; // true if the file has obsolete lines
 
         void parse();
         void add(::Module *m);
+        void compact();
     } genModSet;
+    std::string codegenKey(::Module *m);
 
     // settings
     const char *cachePrefix = "calypso_cache"; // prefix of cached files (list of headers, PCH)
 
     llvm::SmallVector<const clang::VarDecl*, 4> EmittedStaticVars; // static variables emitted at CodeGenModule::Release that need their linkage fixed
-    std::unique_ptr<clangCG::CodeGenModule> CGM;  // selectively emit external C++ declarations, template instances, ...
+    CodeGenSession CGM;  // selectively emit external C++ declarations, template instances, ...
+
+    // with -cpp-dedup-instances the linkonce_odr C++ definitions of every module are moved to a single module,
+    // kept in a cache file named 'calypso_cache.instances.bc' and compiled to __cpp_instances.o
+    std::unique_ptr<llvm::Module> InstancesModule; // instances emitted by this compilation, merged into the cache file by finishCodegen()
+    bool instancesModified = false;
+    llvm::StringMap<llvm::StringSet<>> NewInstanceUsers; // instances used by each object file emitted by this compilation, which may not be written yet
+    llvm::Module *getInstancesModule(llvm::LLVMContext &Ctx);
+    void extractInstances(::Module *m, llvm::Module *lm);
 
     LangPlugin();
     void init(const char *Argv0);
 
     void buildMacroMap();
+    void clearMacroMap();
+    MacroMapEntryTy *getHeaderMacros(const clang::Module::Header &Header);
 
     ASTUnit *getASTUnit() { return pch.AST; }
     clang::ASTContext &getASTContext();
@@ -264,11 +418,6 @@ public:
     
 private:
     void updateCGFInsertPoint();    // CGF has its own IRBuilder, it's not an issue if we set its insert point correctly
-
-    // Keep the existing LLVM types generated by CodeGenTypes between modules
-    llvm::DenseMap<const clang::Type*, clangCG::CGRecordLayout*> CGRecordLayouts;
-    llvm::DenseMap<const clang::Type*, llvm::StructType*> RecordDeclTypes;
-    llvm::DenseMap<const clang::Type *, llvm::Type*> TypeCache;
 };
 
 extern LangPlugin calypso;
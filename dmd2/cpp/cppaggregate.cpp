@@ -3,6 +3,7 @@
 #include "cpp/calypso.h"
 #include "cpp/cppaggregate.h"
 #include "cpp/cppdeclaration.h"
+#include "cpp/cppmodule.h"
 #include "cpp/cpptemplate.h"
 #include "attrib.h"
 #include "scope.h"
@@ -10,6 +11,8 @@
 #include "template.h"
 #include "identifier.h"
 #include "id.h"
+#include "init.h"
+#include "module.h"
 
 #include "clang/AST/Decl.h"
 #include "clang/AST/DeclCXX.h"
@@ -91,13 +94,28 @@ void StructDeclaration::semantic(Scope *sc)
         auto instsd = static_cast<cpp::StructDeclaration*>(
                 m.VisitInstancedClassTemplate(InstRD)->isStructDeclaration());
         assert(instsd);
+        m.flushFunctionsForEmit();
 
         instsd->syntaxCopy(this);
     }
 
+    lazyMembers.setScope(this, sc ? sc : scope);
     ::StructDeclaration::semantic(sc);
 }
 
+void StructDeclaration::semantic3(Scope *sc)
+{
+    if (sc) // not from runDeferredSemantic3 for TypeInfo generation
+        lazyMembers.mapAll(this);
+    ::StructDeclaration::semantic3(sc);
+}
+
+Dsymbol *StructDeclaration::search(Loc loc, Identifier *ident, int flags)
+{
+    lazyMembers.map(this, ident);
+    return ::StructDeclaration::search(loc, ident, flags);
+}
+
 Expression *StructDeclaration::defaultInit(Loc loc)
 {
     if (!defaultCtor)
@@ -147,10 +165,12 @@ void ClassDeclaration::semantic(Scope *sc)
         auto instcd = static_cast<cpp::ClassDeclaration*>(
             m.VisitInstancedClassTemplate(InstRD, DeclMapper::ForcePolymorphic)->isClassDeclaration());
         assert(instcd);
+        m.flushFunctionsForEmit();
 
         instcd->syntaxCopy(this);
     }
 
+    lazyMembers.setScope(this, sc ? sc : scope);
     ::ClassDeclaration::semantic(sc);
 
     // Build a copy ctor alias after scope setting and semantic'ing the C++ copy ctor during which its type is adjusted
@@ -158,6 +178,18 @@ void ClassDeclaration::semantic(Scope *sc)
         buildCpCtor(sc);
 }
 
+void ClassDeclaration::semantic3(Scope *sc)
+{
+    lazyMembers.mapAll(this);
+    ::ClassDeclaration::semantic3(sc);
+}
+
+Dsymbol *ClassDeclaration::search(Loc loc, Identifier *ident, int flags)
+{
+    lazyMembers.map(this, ident);
+    return ::ClassDeclaration::search(loc, ident, flags); // base classes will map their own lazy members
+}
+
 void ClassDeclaration::buildCpCtor(Scope *sc)
 {
 //     auto& S = calypso.getSema();
@@ -336,9 +368,36 @@ Expression *LangPlugin::getRightThis(Loc loc, Scope *sc, ::AggregateDeclaration
     return e1;
 }
 
+// Lvalues of C++ records with a non-trivial copy constructor get copied through it:
+//    (tmp = S(e)), tmp
+// Rvalues are left alone, they're either constructed in place or bound to the move constructor
+// and T&& parameters during overload resolution.
 Expression *LangPlugin::callCpCtor(Scope *sc, Expression *e)
 {
-    // TODO
+    auto tb = e->type->toBasetype();
+    if (tb->ty != Tstruct) // static arrays of C++ records are still blitted
+        return e;
+
+    auto sd = static_cast<TypeStruct*>(tb)->sym;
+    if (sd->isUnionDeclaration())
+        return e;
+
+    auto CRD = dyn_cast_or_null<clang::CXXRecordDecl>(getRecordDecl(sd));
+    if (!CRD || !CRD->hasDefinition() || !CRD->hasNonTrivialCopyConstructor())
+        return e;
+
+    auto ctorcall = new CallExp(e->loc, new TypeExp(e->loc, e->type->mutableOf()), e);
+
+    Identifier *idtmp = Identifier::generateId("__copytmp");
+    auto tmp = new VarDeclaration(e->loc, e->type, idtmp, new ExpInitializer(e->loc, ctorcall));
+    tmp->storage_class |= STCtemp;
+    tmp->noscope = 1;
+    tmp->semantic(sc);
+    Expression *de = new DeclarationExp(e->loc, tmp);
+    Expression *ve = new VarExp(e->loc, tmp);
+    de->type = Type::tvoid;
+    ve->type = e->type;
+    return Expression::combine(de, ve);
 }
 
 ::FuncDeclaration *LangPlugin::buildDtor(::AggregateDeclaration *ad, Scope *sc)
@@ -435,6 +494,19 @@ const clang::RecordDecl *getRecordDecl(::AggregateDeclaration *ad)
    llvm_unreachable("Unknown aggregate decl type?");
 }
 
+LazyMembers *getLazyMembers(::AggregateDeclaration *ad)
+{
+    if (!isCPP(ad) || ad->isUnionDeclaration())
+        return nullptr;
+
+    if (auto sd = ad->isStructDeclaration())
+        return &static_cast<StructDeclaration*>(sd)->lazyMembers;
+    else if (auto cd = ad->isClassDeclaration())
+        return &static_cast<ClassDeclaration*>(cd)->lazyMembers;
+
+    return nullptr;
+}
+
 const clang::RecordDecl *getRecordDecl(::Type *t)
 {
     ::AggregateDeclaration *ad;
@@ -460,6 +532,8 @@ const clang::RecordDecl *getRecordDecl(::Type *t)
     tmap.addImplicitDecls = false;
 
     auto ident = getExtendedIdentifier(FD, tmap);
+    if (auto lazyMembers = getLazyMembers(ad))
+        lazyMembers->map(ad, ident);
 
     auto s = ad->ScopeDsymbol::search(ad->loc, ident);
     if (s && s->isFuncDeclaration())
@@ -486,6 +560,91 @@ const clang::RecordDecl *getRecordDecl(::Type *t)
     return nullptr;
 }
 
+void LazyMembers::setScope(::AggregateDeclaration *ad, Scope *sc)
+{
+    if (membersScope || !sc || Decls.empty())
+        return;
+
+    // Same scope as the one the members get from ::StructDeclaration/::ClassDeclaration::semantic()
+    auto sc2 = sc->push(ad);
+    sc2->stc &= STCsafe | STCtrusted | STCsystem;
+    sc2->parent = ad;
+    sc2->inunion = 0;
+    sc2->protection = Prot(PROTpublic);
+    sc2->explicitProtection = 0;
+    sc2->structalign = STRUCTALIGN_DEFAULT;
+    sc2->userAttribDecl = nullptr;
+    sc2->setNoFree();
+
+    membersScope = sc2;
+}
+
+void LazyMembers::map(::AggregateDeclaration *ad, Identifier *ident)
+{
+    if (!ad->symtab || !membersScope)
+        return; // addMember() hasn't been called on the eager members yet
+
+    auto I = Decls.find(ident);
+    if (I == Decls.end())
+        return;
+
+    auto LazyDecls = std::move(I->second);
+    Decls.erase(I);
+    mapDecls(ad, LazyDecls);
+}
+
+void LazyMembers::mapAll(::AggregateDeclaration *ad)
+{
+    if (!ad->symtab || !membersScope)
+        return;
+
+    // Iterating over Decls would make the order of the members and of the emitted functions vary between runs
+    for (size_t i = 0; i < Order.size(); i++)
+    {
+        auto I = Decls.find(Order[i]);
+        if (I == Decls.end())
+            continue; // already mapped by search(), possibly during the semantic of a previous member
+
+        auto LazyDecls = std::move(I->second);
+        Decls.erase(I);
+        mapDecls(ad, LazyDecls);
+    }
+
+    Order.clear();
+}
+
+void LazyMembers::mapDecls(::AggregateDeclaration *ad, llvm::ArrayRef<const clang::Decl*> LazyDecls)
+{
+    auto mod = ad->getModule();
+    assert(isCPP(mod));
+
+    DeclMapper mapper(static_cast<cpp::Module*>(mod));
+    mapper.rebuildScope(getRecordDecl(ad));
+
+    auto syms = new Dsymbols;
+    for (auto D: LazyDecls)
+        if (auto s = mapper.VisitDecl(D))
+            syms->append(s);
+    mapper.flushFunctionsForEmit();
+
+    // All the overloads have to be in the symbol table before any of them goes through semantic()
+    for (auto s: *syms)
+    {
+        ad->members->push(s);
+        s->addMember(membersScope, ad);
+        s->setScope(membersScope);
+    }
+
+    for (auto s: *syms)
+    {
+        s->semantic(membersScope);
+        if (mod->semanticRun >= PASSsemantic2)
+            s->semantic2(membersScope);
+        if (mod->semanticRun >= PASSsemantic3)
+            s->semantic3(membersScope);
+    }
+}
+
 ::FuncDeclaration* findOverriddenMethod(::FuncDeclaration *md, ::ClassDeclaration *base)
 {
     for (auto s2: base->vtbl)
@@ -12,8 +12,12 @@
 #include "../aggregate.h"
 #include "../attrib.h"
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+
 namespace clang
 {
+class Decl;
 class RecordDecl;
 class CXXRecordDecl; // NOTE: will disappear in a future version of Clang
 struct ThunkInfo;
@@ -23,6 +27,32 @@ namespace cpp
 {
 class FuncDeclaration;
 
+// Plain methods aren't needed for the layout nor the vtable of a record, so instead of mapping them all
+// while importing the module they get mapped only when search() looks them up, when the members get enumerated
+// by __traits, or by the semantic3 of a record from a root module since its object file should define them all
+class LazyMembers
+{
+public:
+    llvm::DenseMap<Identifier*, llvm::SmallVector<const clang::Decl*, 1>> Decls;
+    llvm::SmallVector<Identifier*, 8> Order; // the identifiers in the order of the record's DeclContext
+
+    void add(Identifier *ident, const clang::Decl *D)
+    {
+        auto& IdentDecls = Decls[ident];
+        if (IdentDecls.empty())
+            Order.push_back(ident);
+        IdentDecls.push_back(D);
+    }
+    void setScope(::AggregateDeclaration *ad, Scope *sc);
+    void map(::AggregateDeclaration *ad, Identifier *ident);
+    void mapAll(::AggregateDeclaration *ad);
+
+private:
+    Scope *membersScope = nullptr; // the scope semantic() gives to the aggregate members
+
+    void mapDecls(::AggregateDeclaration *ad, llvm::ArrayRef<const clang::Decl*> LazyDecls);
+};
+
 // All non-polymorphic C++ aggregate types, it doesn't matter whether "struct" or "class"
 // was used and whether another aggregate inherit from it
 class StructDeclaration : public ::StructDeclaration
@@ -32,11 +62,14 @@ public:
 
     const clang::RecordDecl *RD;
     bool layoutQueried = false;
+    LazyMembers lazyMembers;
 
     StructDeclaration(Loc loc, Identifier* id, const clang::RecordDecl* RD);
     StructDeclaration(const StructDeclaration&);
     Dsymbol *syntaxCopy(Dsymbol *s) override;
     void semantic(Scope *sc) override;
+    void semantic3(Scope *sc) override;
+    Dsymbol *search(Loc loc, Identifier *ident, int flags = IgnoreNone) override;
     void buildLayout() override;
     void finalizeSize(Scope *sc) override;
     Expression *defaultInit(Loc loc) override;
@@ -53,12 +86,15 @@ public:
 
     const clang::CXXRecordDecl *RD;
     bool layoutQueried = false;
+    LazyMembers lazyMembers;
 
     ClassDeclaration(Loc loc, Identifier *id, BaseClasses *baseclasses,
                      const clang::CXXRecordDecl *RD);
     ClassDeclaration(const ClassDeclaration&);
     Dsymbol *syntaxCopy(Dsymbol *s) override;
     void semantic(Scope *sc) override;
+    void semantic3(Scope *sc) override;
+    Dsymbol *search(Loc loc, Identifier *ident, int flags = IgnoreNone) override;
     void buildLayout() override;
     bool mayBeAnonymous() override;
     
@@ -103,6 +139,7 @@ public:
 
 const clang::RecordDecl *getRecordDecl(::AggregateDeclaration *ad);
 const clang::RecordDecl *getRecordDecl(::Type *t);
+LazyMembers *getLazyMembers(::AggregateDeclaration *ad);
 ::FuncDeclaration *findMethod(::AggregateDeclaration *ad, const clang::FunctionDecl *FD);
 ::FuncDeclaration *findOverriddenMethod(::FuncDeclaration* md, ::ClassDeclaration* base );
 
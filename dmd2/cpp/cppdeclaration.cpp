@@ -173,6 +173,7 @@ void FuncDeclaration::cppSemantic(::FuncDeclaration *fd, Scope *sc)
 
         auto inst = m.VisitInstancedFunctionTemplate(Inst);
         assert(inst);
+        m.flushFunctionsForEmit();
 
         inst->syntaxCopy(fd);
     }
@@ -179,6 +179,16 @@ public:
 
 
     static Identifier *getIdentifierForTemplateNonTypeParm(const clang::NonTypeTemplateParmDecl *NTTPD);
+
+    // Functions needed by the mapped decls are marked referenced right away, but the instantiation
+    // of their definitions and the walk of their bodies for more functions to emit are done in batches
+    // by flushFunctionsForEmit(), which has to be called once the mapper is done.
+    void markFunctionForEmit(const clang::FunctionDecl *D, bool walkBody = true);
+    void flushFunctionsForEmit();
+
+protected:
+    llvm::SmallVector<const clang::FunctionDecl*, 32> FunctionsForEmit;
+    llvm::DenseMap<const clang::Decl*, bool> MarkedForEmit; // canonical decl -> body walked
 };
 
 // Run semantic() on referenced functions and record decls to instantiate templates and have them codegen'd
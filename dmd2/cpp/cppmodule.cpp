@@ -334,10 +334,22 @@ Dsymbols *DeclMapper::VisitValueDecl(const clang::ValueDecl *D)
     return decldefs;
 }
 
-static void MarkFunctionForEmit(const clang::FunctionDecl *D)
+void DeclMapper::markFunctionForEmit(const clang::FunctionDecl *D, bool walkBody)
 {
     auto& S = calypso.getSema();
-    auto& Diags = calypso.getDiagnostics();
+
+    auto Canon = D->getCanonicalDecl();
+    auto I = MarkedForEmit.find(Canon);
+    if (I != MarkedForEmit.end())
+    {
+        if (walkBody && !I->second)
+        {
+            I->second = true;
+            FunctionsForEmit.push_back(D);
+        }
+        return;
+    }
+    MarkedForEmit[Canon] = walkBody;
 
     if (!D->getDeclContext()->isDependentContext())
     {
@@ -347,19 +359,11 @@ static void MarkFunctionForEmit(const clang::FunctionDecl *D)
         if (FPT && clang::isUnresolvedExceptionSpec(FPT->getExceptionSpecType()))
             S.ResolveExceptionSpec(D->getLocation(), FPT);
 
+        // Only adds the function to Sema's pending instantiations, which get performed by flushFunctionsForEmit()
         S.MarkFunctionReferenced(D->getLocation(), D_);
-        if (Diags.hasErrorOccurred())
-        {
-//             assert(D->isInvalidDecl());
-            Diags.Reset();
-        }
-        S.PerformPendingInstantiations();
-
-        // MarkFunctionReferenced won't instantiate some implicitly instantiable functions
-        // Not fully understanding why, but here's a second attempt
-        if (!D->hasBody() && D->isImplicitlyInstantiable())
-            S.InstantiateFunctionDefinition(D->getLocation(), D_);
     }
+
+    FunctionsForEmit.push_back(D);
 }
 
 // For simplicity's sake (or confusion's) let's call records with either virtual functions or bases polymorphic
@@ -372,6 +376,19 @@ inline bool isPolymorphic(const clang::RecordDecl *D)
             (CRD->getNumBases() || CRD->isPolymorphic());
 }
 
+// Plain methods are the only members not needed by the layout, the vtable or the special member functions,
+// so they may be left to LazyMembers
+static bool isLazyMember(const clang::Decl *D)
+{
+    auto MD = dyn_cast<clang::CXXMethodDecl>(D);
+    if (!MD || MD->isVirtual() || MD->isOverloadedOperator() ||
+            isa<clang::CXXConstructorDecl>(MD) || isa<clang::CXXDestructorDecl>(MD) || isa<clang::CXXConversionDecl>(MD))
+        return false;
+
+    return MD->getIdentifier() && !MD->getDescribedFunctionTemplate() &&
+            MD->getTemplateSpecializationKind() == clang::TSK_Undeclared;
+}
+
 Dsymbols *DeclMapper::VisitRecordDecl(const clang::RecordDecl *D, unsigned flags)
 {
     auto& Context = calypso.getASTContext();
@@ -458,6 +475,13 @@ Dsymbols *DeclMapper::VisitRecordDecl(const clang::RecordDecl *D, unsigned flags
     // atm we're sortof mirroring parseAggregate()
     auto members = new Dsymbols;
 
+    // Records from template instances get all their members mapped at once, the others defer their plain methods
+    LazyMembers *lazyMembers = nullptr;
+    if (!anon && CRD && !CRD->isDependentType() && !D->isInvalidDecl() &&
+            !isa<clang::ClassTemplateSpecializationDecl>(CRD) && !CRD->getInstantiatedFromMemberClass() &&
+            !(flags & MapTemplateInstantiations))
+        lazyMembers = getLazyMembers(a);
+
     if (!isDefined)
         goto Ldeclaration;
 
@@ -476,7 +500,7 @@ Dsymbols *DeclMapper::VisitRecordDecl(const clang::RecordDecl *D, unsigned flags
             auto _CRD = const_cast<clang::CXXRecordDecl *>(CRD);
 
             auto MarkEmit = [&] (clang::FunctionDecl *FD) {
-                if (FD) MarkFunctionForEmit(FD);
+                if (FD) markFunctionForEmit(FD, false);
             };
 
             // Clang declares and defines implicit ctors/assignment operators lazily,
@@ -517,6 +541,12 @@ Dsymbols *DeclMapper::VisitRecordDecl(const clang::RecordDecl *D, unsigned flags
               !isa<clang::RedeclarableTemplateDecl>(M) && !isa<clang::TypedefNameDecl>(M))
             continue;
 
+        if (lazyMembers && isLazyMember(M))
+        {
+            lazyMembers->add(fromIdentifier(cast<clang::NamedDecl>(M)->getIdentifier()), M);
+            continue;
+        }
+
         if (auto s = VisitDecl(M))
             members->append(s);
     }
@@ -607,7 +637,6 @@ class FunctionReferencer : public clang::RecursiveASTVisitor<FunctionReferencer>
     clang::SourceLocation SLoc;
 
     Loc loc;
-    llvm::DenseSet<const clang::FunctionDecl *> Referenced;
 
     bool Reference(const clang::FunctionDecl *Callee);
     bool ReferenceRecord(const clang::RecordType *RT);
@@ -624,25 +653,17 @@ public:
 bool FunctionReferencer::Reference(const clang::FunctionDecl *D)
 {
     auto Callee = const_cast<clang::FunctionDecl*>(D);
-    if (!Callee || Callee->isDeleted() ||
-            Callee->getBuiltinID() || Referenced.count(Callee->getCanonicalDecl()))
+    if (!Callee || Callee->isDeleted() || Callee->getBuiltinID())
         return true;
     if (Callee->isInvalidDecl())
         return false;
-    Referenced.insert(Callee->getCanonicalDecl());
 
-    MarkFunctionForEmit(Callee);
+    mapper.markFunctionForEmit(Callee); // its body will be walked by the next iteration of flushFunctionsForEmit()
 
     if (Callee->isInvalidDecl())
         return false;
 
     mapper.AddImplicitImportForDecl(loc, Callee);
-
-    const clang::FunctionDecl *Def;
-    if (!Callee->hasBody(Def))
-        return true;
-
-    TraverseStmt(Def->getBody());
     return true;
 }
 
@@ -700,6 +721,49 @@ bool FunctionReferencer::VisitCXXDeleteExpr(const clang::CXXDeleteExpr *E)
 }
 }
 
+void DeclMapper::flushFunctionsForEmit()
+{
+    auto& S = calypso.getSema();
+
+    InstantiationChecker::beginBatch();
+
+    // Walking the bodies marks more functions for emit, so keep going until nothing new comes up
+    while (true)
+    {
+        S.PerformPendingInstantiations();
+
+        if (FunctionsForEmit.empty())
+            break;
+
+        decltype(FunctionsForEmit) Batch;
+        Batch.swap(FunctionsForEmit);
+
+        for (auto D: Batch)
+        {
+            auto D_ = const_cast<clang::FunctionDecl*>(D);
+
+            // MarkFunctionReferenced won't instantiate some implicitly instantiable functions
+            // Not fully understanding why, but here's a second attempt
+            if (!D->getDeclContext()->isDependentContext() &&
+                    !D->hasBody() && D->isImplicitlyInstantiable())
+                S.InstantiateFunctionDefinition(D->getLocation(), D_);
+
+            if (D->isInvalidDecl() || !MarkedForEmit[D->getCanonicalDecl()])
+                continue;
+
+            const clang::FunctionDecl *Def;
+            if (D->hasBody(Def))
+                FunctionReferencer(*this, S, clang::SourceLocation()).TraverseStmt(Def->getBody());
+        }
+    }
+
+    InstantiationChecker::endBatch();
+
+    auto& Diags = calypso.getDiagnostics();
+    if (Diags.hasErrorOccurred())
+        Diags.Reset();
+}
+
 bool isMapped(const clang::Decl *D) // TODO
 {
     if (auto FD = dyn_cast<clang::FunctionDecl>(D))
@@ -725,8 +789,6 @@ bool isMapped(const clang::Decl *D) // TODO
 
 Dsymbols *DeclMapper::VisitFunctionDecl(const clang::FunctionDecl *D, unsigned flags)
 {
-    auto& S = calypso.getSema();
-
     if (!isMapped(D))
         return nullptr;
 
@@ -737,14 +799,17 @@ Dsymbols *DeclMapper::VisitFunctionDecl(const clang::FunctionDecl *D, unsigned f
     auto loc = fromLoc(D->getLocation());
     auto MD = dyn_cast<clang::CXXMethodDecl>(D);
 
-    MarkFunctionForEmit(D);
+    markFunctionForEmit(D);
+
+    // The instantiation of the functions marked for emit is deferred to flushFunctionsForEmit(), but a function whose
+    // instantiation fails mustn't be mapped, so the ones getting mapped are instantiated right away
+    if (!D->getDeclContext()->isDependentContext() &&
+            !D->hasBody() && D->isImplicitlyInstantiable())
+        calypso.getSema().InstantiateFunctionDefinition(D->getLocation(), const_cast<clang::FunctionDecl*>(D));
+
     if (D->isInvalidDecl())
         return nullptr;
 
-    const clang::FunctionDecl *Def;
-    if (D->hasBody(Def))
-        FunctionReferencer(*this, S, clang::SourceLocation()).TraverseStmt(Def->getBody());
-
     auto FPT = D->getType()->castAs<clang::FunctionProtoType>();
 
     auto tf = FromType(*this, loc).fromTypeFunction(FPT, D);
@@ -1376,6 +1441,29 @@ const clang::TagDecl *isOverloadedOperatorWithTagOperand(const clang::Decl *D,
     return nullptr;
 }
 
+static const LangPlugin::NonMemberOperatorsTy &getNonMemberOperators(const clang::DeclContext *Ctx)
+{
+    auto& Context = calypso.getASTContext();
+
+    auto Found = calypso.NonMemberOperators.find(Ctx);
+    if (Found != calypso.NonMemberOperators.end())
+        return Found->second;
+
+    auto& Index = calypso.NonMemberOperators[Ctx];
+
+    for (int Op = 1; Op < clang::NUM_OVERLOADED_OPERATORS; Op++)
+    {
+        auto OpName = Context.DeclarationNames.getCXXOperatorName(
+                    static_cast<clang::OverloadedOperatorKind>(Op));
+
+        for (auto OverOp: Ctx->lookup(OpName))
+            if (auto OpTyDecl = isOverloadedOperatorWithTagOperand(OverOp))
+                Index[OpTyDecl->getCanonicalDecl()].push_back(OverOp);
+    }
+
+    return Index;
+}
+
 static clang::Module *tryFindClangModule(Loc loc, Identifiers *packages, Identifier *id,
                                          Package *&p, size_t i)
 {
@@ -1435,9 +1523,8 @@ static inline bool isTopLevelInNamespaceModule (const clang::Decl *D)
     return true;
 }
 
-static void mapNamespace(DeclMapper &mapper,
-                             const clang::DeclContext *DC,
-                             Dsymbols *members,
+static void collectNamespaceDecls(const clang::DeclContext *DC,
+                             llvm::SmallVectorImpl<const clang::Decl*> &Decls,
                              bool forClangModule = false)
 {
     auto CanonDC = cast<clang::Decl>(DC)->getCanonicalDecl();
@@ -1464,49 +1551,36 @@ static void mapNamespace(DeclMapper &mapper,
         auto InnerNS = dyn_cast<clang::NamespaceDecl>(*D);
         if ((InnerNS && InnerNS->isInline()) || isa<clang::LinkageSpecDecl>(*D))
         {
-            mapNamespace(mapper, cast<clang::DeclContext>(*D), members, forClangModule);
+            collectNamespaceDecls(cast<clang::DeclContext>(*D), Decls, forClangModule);
             continue;
         }
         else if (!isTopLevelInNamespaceModule(*D))
             continue;
 
-        if (auto s = mapper.VisitDecl(*D))
-            members->append(s);
+        Decls.push_back(*D);
     }
 }
 
-static void mapClangModule(DeclMapper &mapper,
-                             const clang::Decl *Root,
+static void collectClangModuleDecls(const clang::Decl *Root,
                              clang::Module *M,
-                             Dsymbols *members)
+                             llvm::SmallVectorImpl<const clang::Decl*> &Decls)
 {
     auto AST = calypso.getASTUnit();
     auto& SrcMgr = calypso.getSourceManager();
 
     llvm::SmallVector<clang::Decl*, 32> RegionDecls;
 
-    // HACK-ish but Clang doesn't offer a straightforward way
-    // SourceManager::translateFile() only offers the first FID of a FileEntry which doesn't contain all the decls,
-    // so we need to loop over all the FID corresponding to Header.Entry.
-    auto findRegionDecls = [&] (const clang::SrcMgr::SLocEntry& SLoc) {
-        if (SLoc.isFile() && SLoc.getFile().getContentCache())
-        {
-            for (auto& Header: M->Headers[clang::Module::HK_Normal])
-            {
-                if (SLoc.getFile().getContentCache()->OrigEntry != Header.Entry)
-                    continue;
-
-                auto Loc = clang::SourceLocation::getFromRawEncoding(SLoc.getOffset());
-                auto FID = SrcMgr.getFileID(Loc); // NOTE: getting a FileID without a SourceLocation is impossible, it's locked tight
-                AST->findFileRegionDecls(FID, 0, SrcMgr.getFileIDSize(FID), RegionDecls); // passed Length is the maximum value before offset overflow kicks in
-            }
-        }
-    };
+    // Loop over all the FIDs corresponding to each header, see PCH::FileIDs
+    auto& FileIDs = calypso.pch.FileIDs;
+    for (auto& Header: M->Headers[clang::Module::HK_Normal])
+    {
+        auto I = FileIDs.find(Header.Entry);
+        if (I == FileIDs.end())
+            continue;
 
-    for (unsigned I = 0, N = SrcMgr.local_sloc_entry_size(); I != N; ++I)
-        findRegionDecls(SrcMgr.getLocalSLocEntry(I));
-    for (unsigned I = 0, N = SrcMgr.loaded_sloc_entry_size(); I != N; ++I)
-        findRegionDecls(SrcMgr.getLoadedSLocEntry(I));
+        for (auto FID: I->second)
+            AST->findFileRegionDecls(FID, 0, SrcMgr.getFileIDSize(FID), RegionDecls); // passed Length is the maximum value before offset overflow kicks in
+    }
 
     // Not forgetting namespace redecls
     llvm::SmallVector<clang::Decl*, 8> RootDecls, ParentDecls;
@@ -1546,12 +1620,12 @@ static void mapClangModule(DeclMapper &mapper,
         fatal();
     }
 
-    std::function<void(const clang::Decl *)> Map = [&] (const clang::Decl *D)
+    std::function<void(const clang::Decl *)> Collect = [&] (const clang::Decl *D)
     {
         if (auto LinkSpec = dyn_cast<clang::LinkageSpecDecl>(D))
         {
             for (auto LD: LinkSpec->decls())
-                Map(LD);
+                Collect(LD);
             return;
         }
 
@@ -1563,30 +1637,32 @@ static void mapClangModule(DeclMapper &mapper,
         if (!isTopLevelInNamespaceModule(D))
             return;
 
-        if (auto s = mapper.VisitDecl(D))
-            members->append(s);
+        Decls.push_back(D);
     };
 
     if (!isa<clang::TranslationUnitDecl>(Root))
         for (auto R: RootDecls)
-            mapNamespace(mapper, cast<clang::DeclContext>(R), members, true);
+            collectNamespaceDecls(cast<clang::DeclContext>(R), Decls, true);
     else
-    {
-        // Map the macros contained in the module headers (currently limited to numerical constants)
-        for (auto& Header: M->Headers[clang::Module::HK_Normal])
-        {
-            auto MacroMapEntry = calypso.MacroMap[&Header];
-            if (!MacroMapEntry)
-                continue;
-
-            for (auto& P: *MacroMapEntry)
-                if (auto s = mapper.VisitMacro(P.first, P.second))
-                    members->push(s);
-        }
-
         for (auto D: RegionDecls)
             if (isa<clang::TranslationUnitDecl>(D->getDeclContext()))
-                Map(D);
+                Collect(D);
+}
+
+// Map the macros contained in the module headers (currently limited to numerical constants)
+static void mapClangModuleMacros(DeclMapper &mapper,
+                             clang::Module *M,
+                             Dsymbols *members)
+{
+    for (auto& Header: M->Headers[clang::Module::HK_Normal])
+    {
+        auto MacroMapEntry = calypso.getHeaderMacros(Header);
+        if (!MacroMapEntry)
+            continue;
+
+        for (auto& P: *MacroMapEntry)
+            if (auto s = mapper.VisitMacro(P.first, P.second))
+                members->push(s);
     }
 }
 
@@ -1641,42 +1717,59 @@ Module *Module::load(Loc loc, Identifiers *packages, Identifier *id)
     if (!M)
         M = tryFindClangModule(loc, packages, id, pkg, packages->dim);
 
-    auto m = new Module(moduleName(packages, id).c_str(),
-                        id, packages);
+    auto name = moduleName(packages, id);
+    auto m = new Module(name.c_str(), id, packages);
     m->members = new Dsymbols;
     m->parent = pkg;
     m->loc = loc;
 
     DeclMapper mapper(m);
 
+    // Scanning a namespace or the headers of a Clang module for its top-level decls is costly,
+    // so the result is cached as decl IDs as long as the PCH doesn't change
+    llvm::SmallVector<const clang::Decl*, 64> TopLevelDecls;
+
     if (M)
     {
         auto D = cast<clang::Decl>(DC)->getCanonicalDecl();
         m->rootKey.first = D;
         m->rootKey.second = M;
-        mapClangModule(mapper, D, M, m->members);
+
+        if (isa<clang::TranslationUnitDecl>(D))
+            mapClangModuleMacros(mapper, M, m->members);
+
+        if (!calypso.pch.lookupModuleDecls(name, TopLevelDecls))
+        {
+            collectClangModuleDecls(D, M, TopLevelDecls);
+            calypso.pch.cacheModuleDecls(name, TopLevelDecls);
+        }
     }
     else if (strcmp(id->string, "_") == 0)  // Hardcoded module with all the top-level non-tag decls + the anonymous tags of a namespace which aren't in a Clang module
     {
         m->rootKey.first = cast<clang::Decl>(DC)->getCanonicalDecl();
 
-        auto NS = dyn_cast<clang::NamespaceDecl>(DC);
-        if (!NS)
+        if (!calypso.pch.lookupModuleDecls(name, TopLevelDecls))
         {
-            assert(isa<clang::TranslationUnitDecl>(DC));
-
-            mapNamespace(mapper, DC, m->members);
-        }
-        else
-        {
-            auto I = NS->redecls_begin(),
-                    E = NS->redecls_end();
+            auto NS = dyn_cast<clang::NamespaceDecl>(DC);
+            if (!NS)
+            {
+                assert(isa<clang::TranslationUnitDecl>(DC));
 
-            for (; I != E; ++I)
+                collectNamespaceDecls(DC, TopLevelDecls);
+            }
+            else
             {
-                DC = *I;
-                mapNamespace(mapper, DC, m->members);
+                auto I = NS->redecls_begin(),
+                        E = NS->redecls_end();
+
+                for (; I != E; ++I)
+                {
+                    DC = *I;
+                    collectNamespaceDecls(DC, TopLevelDecls);
+                }
             }
+
+            calypso.pch.cacheModuleDecls(name, TopLevelDecls);
         }
     }
     else
@@ -1730,25 +1823,28 @@ Module *Module::load(Loc loc, Identifiers *packages, Identifier *id)
             m->members->append(s);
 
         // Add the non-member overloaded operators that are meant to work with this record/enum
-        for (int Op = 1; Op < clang::NUM_OVERLOADED_OPERATORS; Op++)
+        auto OpTyDecl = CTD ? CTD->getTemplatedDecl()->getCanonicalDecl() : D;
+
+        for (auto Ctx = D->getDeclContext(); Ctx; Ctx = Ctx->getLookupParent())
         {
-            auto OpName = Context.DeclarationNames.getCXXOperatorName(
-                        static_cast<clang::OverloadedOperatorKind>(Op));
+            if (Ctx->isTransparentContext())
+                continue;
 
-            for (auto Ctx = D->getDeclContext(); Ctx; Ctx = Ctx->getLookupParent())
-            {
-                if (Ctx->isTransparentContext())
-                    continue;
+            auto Ops = getNonMemberOperators(Ctx).lookup(OpTyDecl); // copied, mapping may grow the index
 
-                for (auto OverOp: Ctx->lookup(OpName))
-                    if (isOverloadedOperatorWithTagOperand(OverOp, D))
-                        if (auto s = mapper.VisitDecl(getCanonicalDecl(OverOp)))
-                            m->members->append(s);
-            }
+            for (auto OverOp: Ops)
+                if (auto s = mapper.VisitDecl(getCanonicalDecl(OverOp)))
+                    m->members->append(s);
         }
 
 //         srcFilename = AST->getSourceManager().getFilename(TD->getLocation());
     }
+
+    for (auto D: TopLevelDecls)
+        if (auto s = mapper.VisitDecl(D))
+            m->members->append(s);
+
+    mapper.flushFunctionsForEmit();
     
     amodules.push_back(m);
     pkg->symtab->insert(m);
@@ -12,6 +12,8 @@
 #include "module.h"
 #include "cpp/calypso.h"
 
+#include <string>
+
 namespace clang
 {
 class Decl;
@@ -26,6 +28,7 @@ public:
 
     typedef std::pair<const clang::Decl *, const clang::Module *> RootKey;
     RootKey rootKey;
+    std::string codegenKey; // hash of what the object file gets generated from, set by LangPlugin::needsCodegen
 
     static Package *rootPackage;    // package to store all C++ packages/modules, avoids name clashes (e.g std)
     static Modules amodules;            // array of all modules
@@ -77,6 +77,21 @@ Expression *LangPlugin::semanticTraits(TraitsExp *e, Scope *sc)
 
         return new IntegerExp(e->loc, VTableOffset, Type::tptrdiff_t);
     }
+    else if (e->ident == Identifier::idPool("isTriviallyRelocatable"))
+    {
+        auto t = getType((*e->args)[0])->baseElemOf();
+        auto CRD = dyn_cast_or_null<clang::CXXRecordDecl>(getRecordDecl(t));
+        if (!CRD || !CRD->hasDefinition())
+            goto Ltrue;
+
+        // A memcpy followed by forgetting the source is only equivalent to a move + destruction
+        // if neither of them do anything special. Without a move constructor, moving calls the copy constructor.
+        bool trivialMove = CRD->hasMoveConstructor() ? !CRD->hasNonTrivialMoveConstructor()
+                                                     : !CRD->hasNonTrivialCopyConstructor();
+        if (CRD->isTriviallyCopyable() || (trivialMove && !CRD->hasNonTrivialDestructor()))
+            goto Ltrue;
+        goto Lfalse;
+    }
     else if (e->ident == Identifier::idPool("getBaseOffset"))
     {
         if (dim != 2)
@@ -305,7 +305,32 @@ TypeMapper::FromType::FromType(TypeMapper &tm, Loc loc, TypeQualified *prefix)
 {
 }
 
+// Whether the mapping of T only depends on T, the module and cppPrefix
+bool TypeMapper::FromType::isCacheable(const clang::QualType T)
+{
+    return !tm.addImplicitDecls && !tm.substsyms && !prefix && !TypeOfExpr &&
+            tm.CXXScope.empty() && tm.TempParamScope.empty() &&
+            !T->isDependentType();
+}
+
 Type *TypeMapper::FromType::operator()(const clang::QualType T)
+{
+    if (!isCacheable(T))
+        return fromTypeUncached(T);
+
+    auto& Cache = calypso.FromTypeCache[tm.cppPrefix];
+    auto Key = std::make_pair(T.getAsOpaquePtr(), tm.mod);
+
+    auto I = Cache.find(Key);
+    if (I != Cache.end())
+        return I->second ? I->second->syntaxCopy() : nullptr;
+
+    auto t = fromTypeUncached(T);
+    Cache[Key] = t ? t->syntaxCopy() : nullptr; // semantic() may alter t
+    return t;
+}
+
+Type *TypeMapper::FromType::fromTypeUncached(const clang::QualType T)
 {
     if (isNonSupportedType(T))
         return nullptr;
@@ -1663,6 +1688,10 @@ TypeFunction *TypeMapper::FromType::fromTypeFunction(const clang::FunctionProtoT
         {
             stc |= STCscope | STCref;
             at = at->nextOf();
+
+            // T&& only binds to rvalues, see TypeFunction::callMatch
+            if ((*I)->isRValueReferenceType())
+                stc |= STCrvalueref;
         }
 
         if (FD)
@@ -2057,6 +2086,10 @@ clang::QualType TypeMapper::toType(Loc loc, Type* t, Scope *sc, StorageClass stc
 
     if (stc & STCref)
     {
+        if (stc & STCrvalueref)
+            return Context.getRValueReferenceType(
+                        toType(loc, t, sc, stc & ~(STCref | STCrvalueref)));
+
         t = new TypeReference(t);
         stc &= ~STCref;
     }
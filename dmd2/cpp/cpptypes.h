@@ -136,6 +136,9 @@ public:
     private:
         Type *fromType(const clang::QualType T);  // private alias
 
+        bool isCacheable(const clang::QualType T);
+        Type *fromTypeUncached(const clang::QualType T);
+
         TypeQualified *fromNestedNameSpecifierImpl(const clang::NestedNameSpecifier *NNS);
     };
 
@@ -91,6 +91,7 @@ enum PINLINE;
 #define STCvolatile      0x80000000000LL // destined for volatile in the back end
 #define STCreturn        0x100000000000LL // 'return ref' for function parameters
 #define STCinference     0x200000000000LL // do attribute inference
+#define STCrvalueref     0x400000000000LL // CALYPSO C++ rvalue reference parameter (T&&), only binds to rvalues
 
 const StorageClass STCStorageClass = (STCauto | STCscope | STCstatic | STCextern | STCconst | STCfinal |
     STCabstract | STCsynchronized | STCdeprecated | STCoverride | STClazy | STCalias |
@@ -1345,6 +1345,8 @@ Expression *callCpCtor(Scope *sc, Expression *e)
 //         AggregateDeclaration *ad = getAggregateSym(tv);
 //         if (ad->searchCpCtor())
         StructDeclaration *sd = ((TypeStruct *)tv)->sym;
+        if (auto lp = sd->langPlugin()) // CALYPSO
+            return lp->callCpCtor(sc, e);
         if (sd->postblit)
         {
             /* Create a variable tmp, and replace the argument e with:
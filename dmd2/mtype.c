@@ -6064,6 +6064,19 @@ MATCH TypeFunction::callMatch(Type *tthis, Expressions *args, int flag)
                     goto Nomatch;
             }
 
+            // CALYPSO C++ rvalue references only bind to rvalues, and rvalues prefer them (and thus
+            // move constructors) over lvalue references
+            if (m && p->storageClass & STCscope)
+            {
+                if (p->storageClass & STCrvalueref)
+                {
+                    if (!flag && arg->isLvalue()) // partial ordering mockups are always lvalues
+                        goto Nomatch;
+                }
+                else if (!arg->isLvalue() && m > MATCHconst)
+                    m = MATCHconst;
+            }
+
             /* find most derived alias this type being matched.
              */
             while (1)
@@ -39,6 +39,7 @@
 
 // CALYPSO FIXME
 #include "cpp/calypso.h"
+#include "cpp/cppaggregate.h"
 
 #define LOGSEMANTIC     0
 
@@ -261,6 +262,7 @@ const char* traits[] = {
     "getBaseOffset",
     "getCppVirtualIndex", // CALYPSO quick&dirty addition necessary when we need to compare member function pointers (e.g for moc)
     "isCpp",
+    "isTriviallyRelocatable", // CALYPSO
     NULL
 };
 
@@ -1023,6 +1025,11 @@ Expression *semanticTraits(TraitsExp *e, Scope *sc)
             }
         };
 
+        // CALYPSO C++ records only map their plain methods once looked up
+        if (AggregateDeclaration *ad = sds->isAggregateDeclaration())
+            if (cpp::LazyMembers *lazyMembers = cpp::getLazyMembers(ad))
+                lazyMembers->mapAll(ad);
+
         Identifiers *idents = new Identifiers;
 
         ScopeDsymbol::foreach(sc, sds->members, &PushIdentsDg::dg, idents);
@@ -1041,6 +1048,8 @@ Expression *semanticTraits(TraitsExp *e, Scope *sc)
                     {
                         AggregateDeclaration *ab = (*cd->baseclasses)[i]->base; // CALYPSO WARNING implications?
                         assert(ab);
+                        if (cpp::LazyMembers *lazyMembers = cpp::getLazyMembers(ab)) // CALYPSO
+                            lazyMembers->mapAll(ab);
                         ScopeDsymbol::foreach(NULL, ab->members, &PushIdentsDg::dg, idents);
                         ClassDeclaration *cb = ab->isClassDeclaration();
                         if (cb && cb->baseclasses->dim)
@@ -1238,6 +1247,28 @@ Expression *semanticTraits(TraitsExp *e, Scope *sc)
     {
         return pointerBitmap(e);
     }
+    else if (e->ident == Identifier::idPool("isTriviallyRelocatable")) // CALYPSO
+    {
+        if (dim != 1)
+            goto Ldimerror;
+        RootObject *o = (*e->args)[0];
+        Type *t = isType(o);
+        if (!t)
+        {
+            e->error("type expected as first argument of __traits %s instead of %s", e->ident->toChars(), o->toChars());
+            goto Lfalse;
+        }
+        /* D structs may be moved around with a blit, so only C++ records
+         * with non-trivial move constructors or destructors aren't relocatable.
+         */
+        Type *tb = t->baseElemOf();
+        if (tb->ty == Tstruct || isClassValue(tb))
+        {
+            if (getAggregateSym(tb)->langPlugin())
+                return cpp::calypso.semanticTraits(e, sc);
+        }
+        goto Ltrue;
+    }
     else if (e->ident == Identifier::idPool("getBaseOffset") ||
             e->ident == Identifier::idPool("getCppVirtualIndex") ||
             e->ident == Identifier::idPool("isCpp")) // CALYPSO TODO move to cpp/
@@ -366,6 +366,10 @@ cl::opt<bool, true>
     singleObj("singleobj", cl::desc("Create only a single output object file"),
               cl::location(global.params.singleObj));
 
+cl::opt<unsigned> codegenJobs(
+    "j", cl::desc("Optimize and emit up to <N> object files in parallel"),
+    cl::value_desc("N"), cl::init(1));
+
 cl::opt<bool> linkonceTemplates(
     "linkonce-templates",
     cl::desc(
@@ -382,6 +386,13 @@ cl::opt<bool, true>
             cl::desc("generate code for all template instantiations"),
             cl::location(global.params.allInst));
 
+cl::opt<bool> aaInlineLookup(
+    "aa-inline-lookup",
+    cl::desc("Look up associative array keys of integral, pointer and string "
+             "types inline instead of calling _aaInX (relies on the hash "
+             "table layout of druntime)"),
+    cl::init(false));
+
 cl::opt<unsigned, true> nestedTemplateDepth(
     "template-depth",
     cl::desc(
@@ -422,6 +433,22 @@ cl::opt<std::string> cppCacheDir("cpp-cachedir",
 cl::opt<bool> cppVerboseDiags("cpp-verbosediags",
     cl::desc("Keep Clang diagnostics enabled after the PCH generation. For the time being those are mostly spurious errors from failed instantiations that can be ignored."));
 
+cl::opt<bool> cppDedupInstances("cpp-dedup-instances",
+    cl::desc("Emit the C++ inline functions and template instantiations needed by the compiled modules only once, into __cpp_instances.o (written next to the other object files with -c, and to be linked along with them)"));
+
+cl::opt<unsigned> cppModuleJobs("cpp-module-jobs",
+    cl::desc("Before parsing the C++ headers from scratch, build the Clang modules described by the .modulemap_d files next to them into separate module files, using up to <n> worker processes"),
+    cl::value_desc("n"),
+    cl::init(0));
+
+cl::opt<std::string> cppServer("cpp-server",
+    cl::desc("Keep the C++ PCH loaded and compile the source files sent through the local socket <path> by ldc2 -cpp-connect, with the options given to the server"),
+    cl::value_desc("path"));
+
+cl::opt<std::string> cppConnect("cpp-connect",
+    cl::desc("Have the compile server listening on <path> compile the source files"),
+    cl::value_desc("path"));
+
 static cl::extrahelp footer(
     "\n"
     "-d-debug can also be specified without options, in which case it enables "
@@ -70,18 +70,25 @@ extern cl::opt<llvm::CodeModel::Model> mCodeModel;
 extern cl::opt<bool> disableFpElim;
 extern cl::opt<FloatABI::Type> mFloatABI;
 extern cl::opt<bool, true> singleObj;
+extern cl::opt<unsigned> codegenJobs;
 extern cl::opt<bool> linkonceTemplates;
 extern cl::opt<bool> disableLinkerStripDead;
 
 extern cl::opt<BOUNDSCHECK> boundsCheck;
 extern bool nonSafeBoundsChecks;
 
+extern cl::opt<bool> aaInlineLookup;
+
 extern cl::opt<unsigned, true> nestedTemplateDepth;
 
 // CALYPSO
 extern cl::list<std::string> cppArgs;
 extern cl::opt<std::string> cppCacheDir;
 extern cl::opt<bool> cppVerboseDiags; // mostly diags from failed instantiations that can be ignored
+extern cl::opt<bool> cppDedupInstances;
+extern cl::opt<unsigned> cppModuleJobs;
+extern cl::opt<std::string> cppServer;
+extern cl::opt<std::string> cppConnect;
 
 // Arguments to -d-debug
 extern std::vector<std::string> debugArgs;
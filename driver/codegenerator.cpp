@@ -15,10 +15,19 @@
 #include "module.h"
 #include "parse.h"
 #include "scope.h"
+#include "driver/cl_options.h"
 #include "driver/toobj.h"
 #include "gen/cgforeign.h"
 #include "gen/logger.h"
 #include "gen/runtime.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 void codegenModule(IRState *irs, Module *m, bool emitFullModuleInfo);
 
@@ -86,6 +95,131 @@ void emitSymbolAddrGlobal(llvm::Module &lm, const char *symbolName,
 }
 
 namespace ldc {
+
+/// Optimizes and emits the finished LLVM modules on a pool of worker threads,
+/// while the IR of the next modules is generated on the main thread. Each
+/// worker has its own LLVMContext and TargetMachine, the modules are handed
+/// over as bitcode. The workers don't touch the global error state, their
+/// errors are reported by finish() on the main thread.
+class ParallelObjectWriter {
+public:
+  explicit ParallelObjectWriter(unsigned numThreads);
+  ~ParallelObjectWriter();
+
+  void enqueue(llvm::Module &lm, const char *filename);
+
+  /// Waits for every queued module to be written, then reports the errors.
+  void finish();
+
+private:
+  struct Job {
+    llvm::SmallVector<char, 0> bitcode;
+    std::string filename;
+  };
+
+  void run(llvm::TargetMachine &target);
+
+  std::mutex mutex_;
+  std::condition_variable jobAvailable_;
+  std::condition_variable slotAvailable_;
+  std::deque<Job> jobs_;
+  size_t const maxQueuedJobs_;
+  bool finished_ = false;
+  std::vector<std::string> errors_;
+
+  std::vector<std::unique_ptr<llvm::TargetMachine>> targets_;
+  std::vector<std::thread> threads_;
+};
+
+ParallelObjectWriter::ParallelObjectWriter(unsigned numThreads)
+    : maxQueuedJobs_(2 * numThreads) {
+  const llvm::TargetMachine &tm = *gTargetMachine;
+  for (unsigned i = 0; i < numThreads; ++i) {
+    targets_.emplace_back(tm.getTarget().createTargetMachine(
+        llvm::Triple(tm.getTargetTriple()).str(), tm.getTargetCPU(),
+        tm.getTargetFeatureString(), tm.Options, tm.getRelocationModel(),
+        tm.getCodeModel(), tm.getOptLevel()));
+  }
+  for (auto &target : targets_) {
+    llvm::TargetMachine *t = target.get();
+    threads_.emplace_back([this, t] { run(*t); });
+  }
+}
+
+ParallelObjectWriter::~ParallelObjectWriter() { finish(); }
+
+void ParallelObjectWriter::finish() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    finished_ = true;
+  }
+  jobAvailable_.notify_all();
+
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+  threads_.clear();
+
+  if (errors_.empty()) {
+    return;
+  }
+  for (auto &msg : errors_) {
+    error(Loc(), "%s", msg.c_str());
+  }
+  errors_.clear();
+  fatal();
+}
+
+void ParallelObjectWriter::enqueue(llvm::Module &lm, const char *filename) {
+  Job job;
+  job.filename = filename;
+  {
+    llvm::raw_svector_ostream os(job.bitcode);
+    llvm::WriteBitcodeToFile(&lm, os);
+  }
+
+  // Bound the number of modules waiting in memory.
+  std::unique_lock<std::mutex> lock(mutex_);
+  slotAvailable_.wait(lock, [this] { return jobs_.size() < maxQueuedJobs_; });
+  jobs_.push_back(std::move(job));
+  lock.unlock();
+
+  jobAvailable_.notify_one();
+}
+
+void ParallelObjectWriter::run(llvm::TargetMachine &target) {
+  llvm::LLVMContext context;
+
+  for (;;) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      jobAvailable_.wait(lock, [this] { return finished_ || !jobs_.empty(); });
+      if (jobs_.empty()) {
+        return;
+      }
+      job = std::move(jobs_.front());
+      jobs_.pop_front();
+    }
+    slotAvailable_.notify_one();
+
+    llvm::StringRef bitcode(job.bitcode.data(), job.bitcode.size());
+    auto lm = llvm::parseBitcodeFile(
+        llvm::MemoryBufferRef(bitcode, job.filename), context);
+
+    std::string errorMsg;
+    if (!lm) {
+      errorMsg = "cannot read back the LLVM module of '" + job.filename +
+                 "': " + lm.getError().message();
+    } else if (writeModule(lm->get(), job.filename, target, &errorMsg)) {
+      continue;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    errors_.push_back(std::move(errorMsg));
+  }
+}
+
 CodeGenerator::CodeGenerator(llvm::LLVMContext &context, bool singleObj)
     : context_(context), moduleCount_(0), singleObj_(singleObj), ir_(nullptr),
       firstModuleObjfileName_(nullptr) {
@@ -94,6 +228,11 @@ CodeGenerator::CodeGenerator(llvm::LLVMContext &context, bool singleObj)
                  "configured properly");
     fatal();
   }
+
+  // The logger isn't thread-safe.
+  if (!singleObj_ && opts::codegenJobs > 1 && !Logger::enabled()) {
+    writer_.reset(new ParallelObjectWriter(opts::codegenJobs));
+  }
 }
 
 CodeGenerator::~CodeGenerator() {
@@ -114,6 +253,10 @@ CodeGenerator::~CodeGenerator() {
 
     writeAndFreeLLModule(filename);
   }
+
+  if (writer_) {
+    writer_->finish();
+  }
 }
 
 void CodeGenerator::prepareLLModule(Module *m) {
@@ -182,7 +325,11 @@ void CodeGenerator::writeAndFreeLLModule(const char *filename) {
       {llvm::MDString::get(ir_->context(), Version)};
   IdentMetadata->addOperand(llvm::MDNode::get(ir_->context(), IdentNode));
 
-  writeModule(&ir_->module, filename);
+  if (writer_) {
+    writer_->enqueue(ir_->module, filename);
+  } else {
+    writeModule(&ir_->module, filename);
+  }
   global.params.objfiles->push(const_cast<char *>(filename));
   delete ir_;
   ir_ = nullptr;
@@ -21,9 +21,12 @@
 #define LDC_DRIVER_CODEGENERATOR_H
 
 #include "gen/irstate.h"
+#include <memory>
 
 namespace ldc {
 
+class ParallelObjectWriter;
+
 class CodeGenerator {
 public:
   CodeGenerator(llvm::LLVMContext &context, bool singleObj);
@@ -40,6 +43,7 @@ private:
   bool const singleObj_;
   IRState *ir_;
   const char *firstModuleObjfileName_;
+  std::unique_ptr<ParallelObjectWriter> writer_; // with -j N
 };
 }
 
@@ -0,0 +1,305 @@
+//===-- compileserver.cpp -------------------------------------------------===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the BSD-style LDC license. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Protocol: the client connects, sends its stdout and stderr file descriptors
+// along with a single byte, then its working directory and the absolute paths
+// of the source files as NUL-terminated strings followed by an empty string.
+// The server answers with the exit status of the compilation as a 32-bit
+// integer once it's finished.
+//
+//===----------------------------------------------------------------------===//
+
+#include "driver/compileserver.h"
+
+#include "errors.h"
+#include "mars.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace ldc {
+
+#ifndef _WIN32
+
+namespace {
+
+bool initAddress(const std::string &socketPath, sockaddr_un &addr) {
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(addr.sun_path)) {
+    error(Loc(), "socket path '%s' is too long", socketPath.c_str());
+    return false;
+  }
+  strcpy(addr.sun_path, socketPath.c_str());
+  return true;
+}
+
+bool writeAll(int fd, const void *buf, size_t size) {
+  auto p = static_cast<const char *>(buf);
+  while (size) {
+    auto n = write(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool readAll(int fd, void *buf, size_t size) {
+  auto p = static_cast<char *>(buf);
+  while (size) {
+    auto n = read(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool sendFds(int sock, int fd1, int fd2) {
+  char byte = 0;
+  iovec iov = {&byte, 1};
+
+  char control[CMSG_SPACE(2 * sizeof(int))];
+  memset(control, 0, sizeof(control));
+
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  auto cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+  int fds[2] = {fd1, fd2};
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  return sendmsg(sock, &msg, 0) == 1;
+}
+
+bool receiveFds(int sock, int &fd1, int &fd2) {
+  char byte;
+  iovec iov = {&byte, 1};
+
+  char control[CMSG_SPACE(2 * sizeof(int))];
+
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  if (recvmsg(sock, &msg, 0) != 1)
+    return false;
+
+  auto cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+    return false;
+
+  int fds[2];
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  fd1 = fds[0];
+  fd2 = fds[1];
+  return true;
+}
+
+bool receiveFiles(int sock, std::vector<std::string> &files) {
+  std::string current;
+  char c;
+  while (readAll(sock, &c, 1)) {
+    if (c != '\0') {
+      current.push_back(c);
+      continue;
+    }
+    if (current.empty())
+      return true;
+    files.push_back(current);
+    current.clear();
+  }
+  return false;
+}
+
+} // anonymous namespace
+
+void serveCompilations(const std::string &socketPath, Strings &files) {
+  sockaddr_un addr;
+  if (!initAddress(socketPath, addr))
+    fatal();
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socketPath.c_str());
+  if (listener < 0 ||
+      bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) ||
+      listen(listener, 16)) {
+    error(Loc(), "cannot listen on '%s': %s", socketPath.c_str(),
+          strerror(errno));
+    fatal();
+  }
+
+  // A client going away mustn't take the server down with it
+  signal(SIGPIPE, SIG_IGN);
+
+  if (global.params.verbose)
+    fprintf(global.stdmsg, "serving   %s\n", socketPath.c_str());
+
+  // Requests are served one at a time, since the compilations share the
+  // same cache files.
+  while (true) {
+    int conn = accept(listener, nullptr, nullptr);
+    if (conn < 0) {
+      if (errno == EINTR)
+        continue;
+      error(Loc(), "accept() failed: %s", strerror(errno));
+      fatal();
+    }
+
+    int outFd = -1, errFd = -1;
+    std::vector<std::string> request;
+    if (!receiveFds(conn, outFd, errFd) || !receiveFiles(conn, request) ||
+        request.size() < 2) {
+      if (outFd >= 0)
+        close(outFd);
+      if (errFd >= 0)
+        close(errFd);
+      close(conn);
+      continue;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(listener);
+      close(conn);
+      signal(SIGPIPE, SIG_DFL);
+
+      dup2(outFd, STDOUT_FILENO);
+      dup2(errFd, STDERR_FILENO);
+      close(outFd);
+      close(errFd);
+
+      // Default and relative output paths are relative to the client's
+      // working directory
+      if (chdir(request[0].c_str())) {
+        error(Loc(), "cannot change to the working directory '%s': %s",
+              request[0].c_str(), strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+
+      files.setDim(0);
+      for (size_t i = 1; i < request.size(); i++)
+        files.push(strdup(request[i].c_str()));
+      return; // carry on with the compilation in the child
+    }
+
+    close(outFd);
+    close(errFd);
+
+    int32_t exitStatus = EXIT_FAILURE;
+    if (pid > 0) {
+      int status;
+      while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+      if (WIFEXITED(status))
+        exitStatus = WEXITSTATUS(status);
+      else if (WIFSIGNALED(status))
+        exitStatus = 128 + WTERMSIG(status);
+    } else {
+      error(Loc(), "fork() failed: %s", strerror(errno));
+      global.errors = 0; // keep serving
+    }
+
+    writeAll(conn, &exitStatus, sizeof(exitStatus));
+    close(conn);
+  }
+}
+
+int requestCompilation(const std::string &socketPath, Strings &files) {
+  sockaddr_un addr;
+  if (!initAddress(socketPath, addr))
+    return EXIT_FAILURE;
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0 ||
+      connect(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))) {
+    error(Loc(), "cannot connect to the compile server at '%s': %s",
+          socketPath.c_str(), strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+
+  bool ok = sendFds(sock, STDOUT_FILENO, STDERR_FILENO);
+
+  llvm::SmallString<128> cwd;
+  if (llvm::sys::fs::current_path(cwd)) {
+    error(Loc(), "cannot get the working directory");
+    close(sock);
+    return EXIT_FAILURE;
+  }
+  ok = ok && writeAll(sock, cwd.c_str(), cwd.size() + 1);
+
+  // The server doesn't share our working directory
+  for (unsigned i = 0; ok && i < files.dim; i++) {
+    llvm::SmallString<128> path(files[i]);
+    llvm::sys::fs::make_absolute(path);
+    ok = writeAll(sock, path.c_str(), path.size() + 1);
+  }
+  ok = ok && writeAll(sock, "", 1);
+
+  int32_t exitStatus;
+  if (!ok || !readAll(sock, &exitStatus, sizeof(exitStatus))) {
+    error(Loc(), "the compile server at '%s' hung up", socketPath.c_str());
+    exitStatus = EXIT_FAILURE;
+  }
+
+  close(sock);
+  return exitStatus;
+}
+
+#else
+
+void serveCompilations(const std::string &socketPath, Strings &files) {
+  error(Loc(), "-cpp-server is not supported on this platform");
+  fatal();
+}
+
+int requestCompilation(const std::string &socketPath, Strings &files) {
+  error(Loc(), "-cpp-connect is not supported on this platform");
+  return EXIT_FAILURE;
+}
+
+#endif
+
+}
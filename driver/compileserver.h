@@ -0,0 +1,38 @@
+//===-- driver/compileserver.h - Resident compiler process ------*- C++ -*-===//
+//
+//                         LDC – the LLVM D compiler
+//
+// This file is distributed under the BSD-style LDC license. See the LICENSE
+// file for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// A compile server is an ldc2 process started with -cpp-server=<socket>. It
+// keeps the C++ PCH and whatever else was initialized at startup in memory,
+// and forks a child for every compilation requested by an ldc2 process started
+// with -cpp-connect=<socket>. The child inherits the resident state, moves to
+// the client's working directory, compiles the source files sent by the client
+// with the options the server was started with, and writes its output to the
+// client's stdout/stderr. The client can't pass any other option.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LDC_DRIVER_COMPILESERVER_H
+#define LDC_DRIVER_COMPILESERVER_H
+
+#include "filename.h"
+#include <string>
+
+namespace ldc {
+
+/// Listens on socketPath and serves compilation requests. Only returns inside
+/// the forked children, after files was replaced by the files of the request.
+void serveCompilations(const std::string &socketPath, Strings &files);
+
+/// Sends files to the server listening on socketPath and waits for the
+/// compilation to finish. Returns the exit status of the compilation.
+int requestCompilation(const std::string &socketPath, Strings &files);
+
+}
+
+#endif
@@ -24,6 +24,7 @@
 #include "dmd2/target.h"
 #include "driver/cl_options.h"
 #include "driver/codegenerator.h"
+#include "driver/compileserver.h"
 #include "driver/configfile.h"
 #include "driver/exe_path.h"
 #include "driver/ldc-version.h"
@@ -932,7 +933,7 @@ int main(int argc, char **argv) {
   Strings files;
   parseCommandLine(argc, argv, files, helpOnly);
 
-  if (files.dim == 0 && !helpOnly) {
+  if (files.dim == 0 && !helpOnly && opts::cppServer.empty()) {
     cl::PrintHelpMessage();
     return EXIT_FAILURE;
   }
@@ -941,6 +942,24 @@ int main(int argc, char **argv) {
     fatal();
   }
 
+  // CALYPSO
+  if (!opts::cppConnect.empty()) {
+    // Only the source files are sent, the options of the server apply
+    for (int i = 1; i < argc; i++) {
+      llvm::StringRef arg(argv[i]);
+      if (arg.startswith("-") && !arg.ltrim('-').startswith("cpp-connect")) {
+        error(Loc(), "-cpp-connect can't be combined with %s, the compilation "
+                     "uses the options the server was started with",
+              argv[i]);
+      }
+    }
+    if (global.errors) {
+      fatal();
+    }
+
+    return ldc::requestCompilation(opts::cppConnect, files);
+  }
+
   // Set up the TargetMachine.
   ExplicitBitness::Type bitness = ExplicitBitness::None;
   if ((m32bits || m64bits) && (!mArch.empty() || !mTargetTriple.empty())) {
@@ -1045,6 +1064,13 @@ int main(int argc, char **argv) {
     }
   }
 
+  // CALYPSO Load the PCH once and for all, the compilations get served by
+  // forked children of this process
+  if (!opts::cppServer.empty()) {
+    cpp::calypso.pch.preload();
+    ldc::serveCompilations(opts::cppServer, files);
+  }
+
   if (global.params.addMain) {
     // a dummy name, we never actually look up this file
     files.push(const_cast<char *>(global.main_d));
@@ -1274,27 +1300,32 @@ int main(int argc, char **argv) {
 
   // Generate one or more object/IR/bitcode files.
   if (global.params.obj && !modules.empty()) {
-    ldc::CodeGenerator cg(llvm::getGlobalContext(), singleObj);
+    {
+      ldc::CodeGenerator cg(llvm::getGlobalContext(), singleObj);
 
-    for (unsigned i = 0; i < modules.dim; i++) {
-      Module *const m = modules[i];
-      if (global.params.verbose) {
-        fprintf(global.stdmsg, "code      %s\n", m->toChars());
-      }
+      for (unsigned i = 0; i < modules.dim; i++) {
+        Module *const m = modules[i];
+        if (global.params.verbose) {
+          fprintf(global.stdmsg, "code      %s\n", m->toChars());
+        }
 
-      auto lp = m->langPlugin();
-      if (lp && !singleObj && !lp->needsCodegen(m)) { // CALYPSO UGLY?
-          global.params.objfiles->push(m->objfile->name->str);
-          continue;
-      }
+        auto lp = m->langPlugin();
+        if (lp && !singleObj && !lp->needsCodegen(m)) { // CALYPSO UGLY?
+            global.params.objfiles->push(m->objfile->name->str);
+            continue;
+        }
 
-      m->deleteObjFile(); // CALYPSO
-      cg.emit(m);
+        m->deleteObjFile(); // CALYPSO
+        cg.emit(m);
 
-      if (global.errors) {
-        fatal();
+        if (global.errors) {
+          fatal();
+        }
       }
-    }
+    } // the -j workers are joined and the single object is written before the plugins finish
+
+    for (auto lp: global.langPlugins) // CALYPSO
+      lp->codegen()->finishCodegen();
   }
 
   // Generate DDoc output files.
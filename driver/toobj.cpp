@@ -95,7 +95,7 @@ static void codegenModule(llvm::TargetMachine &Target, llvm::Module &m,
   Passes.run(m);
 }
 
-static void assemble(const std::string &asmpath, const std::string &objpath) {
+static bool assemble(const std::string &asmpath, const std::string &objpath) {
   std::vector<std::string> args;
   args.push_back("-O3");
   args.push_back("-c");
@@ -147,10 +147,7 @@ static void assemble(const std::string &asmpath, const std::string &objpath) {
   // Run the compiler to assembly the program.
   std::string gcc(getGcc());
   int R = executeToolAndWait(gcc, args, global.params.verbose);
-  if (R) {
-    error(Loc(), "Error while invoking external assembler.");
-    fatal();
-  }
+  return R == 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -176,6 +173,8 @@ static void printDebugLoc(const DebugLoc &debugLoc, formatted_raw_ostream &os) {
 }
 
 class AssemblyAnnotator : public AssemblyAnnotationWriter {
+  const DataLayout &DL;
+
 // Find the MDNode which corresponds to the DISubprogram data that described F.
 #if LDC_LLVM_VER >= 307
   static DISubprogram *FindSubprogram(const Function *F,
@@ -219,6 +218,8 @@ class AssemblyAnnotator : public AssemblyAnnotationWriter {
   }
 
 public:
+  explicit AssemblyAnnotator(const DataLayout &DL) : DL(DL) {}
+
   void emitFunctionAnnot(const Function *F,
                          formatted_raw_ostream &os) LLVM_OVERRIDE {
     os << "; [#uses = " << F->getNumUses() << ']';
@@ -245,7 +246,7 @@ public:
         os << ", type = " << *val.getType();
       } else if (isa<AllocaInst>(&val)) {
         os << ", size/byte = "
-           << gDataLayout->getTypeAllocSize(val.getType()->getContainedType(0));
+           << DL.getTypeAllocSize(val.getType()->getContainedType(0));
       }
       os << ']';
     }
@@ -335,8 +336,23 @@ public:
 } // end of anonymous namespace
 
 void writeModule(llvm::Module *m, std::string filename) {
+  writeModule(m, std::move(filename), *gTargetMachine, nullptr);
+}
+
+bool writeModule(llvm::Module *m, std::string filename,
+                 llvm::TargetMachine &target, std::string *errorMsg) {
+  auto fail = [errorMsg](const llvm::Twine &msg) {
+    if (errorMsg) {
+      *errorMsg = msg.str();
+      return false;
+    }
+    error(Loc(), "%s", msg.str().c_str());
+    fatal();
+    return false;
+  };
+
   // run optimizer
-  ldc_optimize_module(m);
+  ldc_optimize_module(m, target);
 
   // There is no integrated assembler on AIX because XCOFF is not supported.
   // Starting with LLVM 3.5 the integrated assembler can be used with MinGW.
@@ -364,9 +380,8 @@ void writeModule(llvm::Module *m, std::string filename) {
     ErrorInfo errinfo;
     llvm::raw_fd_ostream bos(bcpath.c_str(), errinfo, llvm::sys::fs::F_None);
     if (bos.has_error()) {
-      error(Loc(), "cannot write LLVM bitcode file '%s': %s", bcpath.c_str(),
-            ERRORINFO_STRING(errinfo));
-      fatal();
+      return fail(llvm::Twine("cannot write LLVM bitcode file '") + bcpath +
+                  "': " + ERRORINFO_STRING(errinfo));
     }
     llvm::WriteBitcodeToFile(m, bos);
   }
@@ -379,11 +394,14 @@ void writeModule(llvm::Module *m, std::string filename) {
     ErrorInfo errinfo;
     llvm::raw_fd_ostream aos(llpath.c_str(), errinfo, llvm::sys::fs::F_None);
     if (aos.has_error()) {
-      error(Loc(), "cannot write LLVM asm file '%s': %s", llpath.c_str(),
-            ERRORINFO_STRING(errinfo));
-      fatal();
+      return fail(llvm::Twine("cannot write LLVM asm file '") + llpath +
+                  "': " + ERRORINFO_STRING(errinfo));
     }
-    AssemblyAnnotator annotator;
+#if LDC_LLVM_VER >= 307
+    AssemblyAnnotator annotator(m->getDataLayout());
+#else
+    AssemblyAnnotator annotator(*gDataLayout);
+#endif
     m->print(aos, &annotator);
   }
 
@@ -405,16 +423,16 @@ void writeModule(llvm::Module *m, std::string filename) {
       if (errinfo.empty())
 #endif
       {
-        codegenModule(*gTargetMachine, *m, out,
+        codegenModule(target, *m, out,
                       llvm::TargetMachine::CGFT_AssemblyFile);
       } else {
-        error(Loc(), "cannot write native asm: %s", ERRORINFO_STRING(errinfo));
-        fatal();
+        return fail(llvm::Twine("cannot write native asm: ") +
+                    ERRORINFO_STRING(errinfo));
       }
     }
 
-    if (assembleExternally) {
-      assemble(spath.str(), filename);
+    if (assembleExternally && !assemble(spath.str(), filename)) {
+      return fail("Error while invoking external assembler.");
     }
 
     if (!global.params.output_s) {
@@ -434,14 +452,15 @@ void writeModule(llvm::Module *m, std::string filename) {
       if (errinfo.empty())
 #endif
       {
-        codegenModule(*gTargetMachine, *m, out,
+        codegenModule(target, *m, out,
                       llvm::TargetMachine::CGFT_ObjectFile);
       } else {
-        error(Loc(), "cannot write object file: %s", ERRORINFO_STRING(errinfo));
-        fatal();
+        return fail(llvm::Twine("cannot write object file: ") +
+                    ERRORINFO_STRING(errinfo));
       }
     }
   }
 
 #undef ERRORINFO_STRING
+  return true;
 }
@@ -18,8 +18,16 @@
 
 namespace llvm {
 class Module;
+class TargetMachine;
 }
 
 void writeModule(llvm::Module *m, std::string filename);
 
+/// Optimizes and emits the module using the given target machine. If errorMsg
+/// is null the errors are fatal, otherwise the first one is stored there and
+/// false is returned, so that the -j worker threads leave the global error
+/// state to the main thread.
+bool writeModule(llvm::Module *m, std::string filename,
+                 llvm::TargetMachine &target, std::string *errorMsg);
+
 #endif
@@ -10,9 +10,15 @@
 #include "gen/aa.h"
 #include "aggregate.h"
 #include "declaration.h"
+#include "expression.h"
+#include "identifier.h"
 #include "module.h"
 #include "mtype.h"
+#include "driver/cl_options.h"
+#include "gen/arrays.h"
+#include "gen/classes.h"
 #include "gen/dvalue.h"
+#include "gen/functions.h"
 #include "gen/irstate.h"
 #include "gen/llvm.h"
 #include "gen/llvmhelpers.h"
@@ -32,14 +38,225 @@ static LLValue *to_keyti(DValue *aa) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-DValue *DtoAAIndex(Loc &loc, Type *type, DValue *aa, DValue *key, bool lvalue) {
-  // D2:
-  // call:
-  // extern(C) void* _aaGetY(AA* aa, TypeInfo aati, size_t valuesize, void*
-  // pkey)
-  // or
-  // extern(C) void* _aaInX(AA aa*, TypeInfo keyti, void* pkey)
+// With -aa-inline-lookup, 'key in aa' and reading aa[key] probe the hash table
+// of druntime's rt.aaA inline for integral, pointer and string keys, instead of
+// calling _aaInX which goes through the virtual TypeInfo getHash and equals of
+// the key for every bucket visited. This follows its layout:
+//  - AA.impl points to an Impl whose first field is Bucket[] buckets, the
+//    number of buckets being a power of 2,
+//  - Bucket is { size_t hash; void* entry; }, the hash of an empty bucket
+//    being 0 which ends the probing,
+//  - an entry holds the key, then the value at talign(keysz, valuealign),
+//  - the bucket hash is mix(keyti.getHash(&key)) | HASH_FILLED_MARK, and the
+//    buckets are visited with triangular (i + j) & mask steps.
+
+enum class AAInlineKey { None, Value, String };
+
+static AAInlineKey getAAInlineKey(Type *keyType) {
+  uint64_t keySize = keyType->size();
+  uint64_t hashSize = getTypeAllocSize(DtoSize_t());
+
+  switch (keyType->ty) {
+  case Tpointer:
+    return AAInlineKey::Value;
+  // TypeInfo.getHash zero-extends these
+  case Tchar:
+  case Twchar:
+  case Tdchar:
+  case Tuns8:
+  case Tuns16:
+  case Tuns32:
+  case Tuns64:
+    return keySize <= hashSize ? AAInlineKey::Value : AAInlineKey::None;
+  // the extension of signed keys differs between the TypeInfos
+  case Tint8:
+  case Tint16:
+  case Tint32:
+  case Tint64:
+    return keySize == hashSize ? AAInlineKey::Value : AAInlineKey::None;
+  // TypeInfo_Array.equals compares the code units bitwise, only the hash is
+  // left to getHash
+  case Tarray:
+    switch (keyType->nextOf()->toBasetype()->ty) {
+    case Tchar:
+    case Twchar:
+    case Tdchar:
+      return AAInlineKey::String;
+    default:
+      return AAInlineKey::None;
+    }
+  default:
+    return AAInlineKey::None;
+  }
+}
+
+// keyti.getHash(pkey), through the vtable of TypeInfo
+static LLValue *DtoAAKeyTypeInfoHash(DValue *aa, LLValue *pkey) {
+  auto fdecl = search_function(Type::dtypeinfo, Identifier::idPool("getHash"))
+                   ->isFuncDeclaration();
+  DtoResolveFunction(fdecl);
+  DtoDeclareFunction(fdecl);
+  llvm::Function *decl = getIrFunc(fdecl)->func;
+
+  LLValue *keyti = DtoBitCast(to_keyti(aa), DtoType(Type::dtypeinfo->type));
+  char name[] = "aa.getHash";
+  LLValue *funcval = DtoVirtualFunctionPointer(
+      new DImValue(Type::dtypeinfo->type, keyti), fdecl, name);
+
+  LLFunctionType *funcTy = decl->getFunctionType();
+  LLValue *args[] = {keyti, DtoBitCast(pkey, funcTy->getParamType(1))};
+  LLCallSite call =
+      gIR->func()->scopes->callOrInvoke(funcval, args, "aa.hash");
+  call.setAttributes(decl->getAttributes());
+  call.setCallingConv(decl->getCallingConv());
+  return call.getInstruction();
+}
 
+// Returns a pointer to the value of key in aa, null if it's not there, or
+// nullptr if the key type can't be looked up inline.
+static LLValue *DtoAAInlineLookup(Loc &loc, DValue *aa, DValue *key) {
+  if (!opts::aaInlineLookup) {
+    return nullptr;
+  }
+
+  TypeAArray *aatype = static_cast<TypeAArray *>(aa->type->toBasetype());
+  Type *keyType = aatype->index->toBasetype();
+  AAInlineKey kind = getAAInlineKey(keyType);
+  if (kind == AAInlineKey::None) {
+    Logger::println("key type %s not looked up inline", keyType->toChars());
+    return nullptr;
+  }
+
+  LLType *sizeTy = DtoSize_t();
+  unsigned hashBits = sizeTy->getIntegerBitWidth();
+
+  // the key hash as computed by rt.aaA.calcHash()
+  LLValue *keyval = key->getRVal();
+  LLValue *hash;
+  if (kind == AAInlineKey::String) {
+    hash = DtoAAKeyTypeInfoHash(aa, makeLValue(loc, key));
+  } else if (keyType->ty == Tpointer) {
+    hash = gIR->ir->CreatePtrToInt(keyval, sizeTy);
+  } else {
+    hash = gIR->ir->CreateZExtOrBitCast(keyval, sizeTy);
+  }
+  hash = gIR->ir->CreateXor(hash, gIR->ir->CreateLShr(hash, 13));
+  hash = gIR->ir->CreateMul(hash, LLConstantInt::get(sizeTy, 0x5bd1e995));
+  hash = gIR->ir->CreateXor(hash, gIR->ir->CreateLShr(hash, 15));
+  hash = gIR->ir->CreateOr(
+      hash, LLConstantInt::get(sizeTy, uint64_t(1) << (hashBits - 1)),
+      "aa.hash");
+
+  LLType *bucketTy =
+      LLStructType::get(gIR->context(), {sizeTy, getVoidPtrType()});
+  LLType *implTy =
+      LLStructType::get(gIR->context(), {sizeTy, getPtrToType(bucketTy)});
+
+  llvm::BasicBlock *entrybb = gIR->scopebb();
+  llvm::BasicBlock *initbb =
+      llvm::BasicBlock::Create(gIR->context(), "aa.probe.init", gIR->topfunc());
+  llvm::BasicBlock *loopbb =
+      llvm::BasicBlock::Create(gIR->context(), "aa.probe", gIR->topfunc());
+  llvm::BasicBlock *keybb =
+      llvm::BasicBlock::Create(gIR->context(), "aa.probe.key", gIR->topfunc());
+  llvm::BasicBlock *emptybb =
+      llvm::BasicBlock::Create(gIR->context(), "aa.probe.empty", gIR->topfunc());
+  llvm::BasicBlock *nextbb =
+      llvm::BasicBlock::Create(gIR->context(), "aa.probe.next", gIR->topfunc());
+  llvm::BasicBlock *foundbb =
+      llvm::BasicBlock::Create(gIR->context(), "aa.probe.found", gIR->topfunc());
+  llvm::BasicBlock *endbb =
+      llvm::BasicBlock::Create(gIR->context(), "aa.probe.end", gIR->topfunc());
+
+  // a null AA holds nothing
+  LLValue *impl = DtoBitCast(aa->getRVal(), getPtrToType(implTy));
+  gIR->ir->CreateCondBr(gIR->ir->CreateIsNull(impl), endbb, initbb);
+
+  gIR->scope() = IRScope(initbb);
+  LLValue *dim = DtoLoad(DtoGEPi(impl, 0, 0), "aa.dim");
+  LLValue *buckets = DtoLoad(DtoGEPi(impl, 0, 1), "aa.buckets");
+  LLValue *mask = gIR->ir->CreateSub(dim, DtoConstSize_t(1), "aa.mask");
+  LLValue *first = gIR->ir->CreateAnd(hash, mask);
+  llvm::BranchInst::Create(loopbb, initbb);
+
+  gIR->scope() = IRScope(loopbb);
+  llvm::PHINode *i = gIR->ir->CreatePHI(sizeTy, 2, "aa.i");
+  llvm::PHINode *j = gIR->ir->CreatePHI(sizeTy, 2, "aa.j");
+  i->addIncoming(first, initbb);
+  j->addIncoming(DtoConstSize_t(1), initbb);
+  LLValue *bucket = DtoGEP1(buckets, i, true);
+  LLValue *bucketHash = DtoLoad(DtoGEPi(bucket, 0, 0), "aa.bucket.hash");
+  gIR->ir->CreateCondBr(gIR->ir->CreateICmpEQ(bucketHash, hash), keybb,
+                        emptybb);
+
+  // compare the keys, once their hashes matched
+  gIR->scope() = IRScope(keybb);
+  LLValue *entry = DtoLoad(DtoGEPi(bucket, 0, 1), "aa.entry");
+  LLValue *entryKey =
+      DtoLoad(DtoBitCast(entry, getPtrToType(DtoType(keyType))), "aa.key");
+  LLValue *sameKey;
+  if (kind == AAInlineKey::String) {
+    llvm::BasicBlock *lengthbb = gIR->scopebb();
+    llvm::BasicBlock *memcmpbb = llvm::BasicBlock::Create(
+        gIR->context(), "aa.probe.memcmp", gIR->topfunc());
+    llvm::BasicBlock *comparedbb = llvm::BasicBlock::Create(
+        gIR->context(), "aa.probe.compared", gIR->topfunc());
+
+    LLValue *len = DtoArrayLen(key);
+    LLValue *sameLength = gIR->ir->CreateICmpEQ(
+        gIR->ir->CreateExtractValue(entryKey, 0), len);
+    gIR->ir->CreateCondBr(sameLength, memcmpbb, comparedbb);
+
+    gIR->scope() = IRScope(memcmpbb);
+    LLValue *size = gIR->ir->CreateMul(
+        len, DtoConstSize_t(keyType->nextOf()->toBasetype()->size()));
+    LLValue *val = DtoMemCmp(gIR->ir->CreateExtractValue(entryKey, 1),
+                             DtoArrayPtr(key), size);
+    LLValue *sameContents =
+        gIR->ir->CreateICmpEQ(val, LLConstantInt::get(val->getType(), 0));
+    memcmpbb = gIR->scopebb();
+    llvm::BranchInst::Create(comparedbb, memcmpbb);
+
+    gIR->scope() = IRScope(comparedbb);
+    llvm::PHINode *phi =
+        gIR->ir->CreatePHI(LLType::getInt1Ty(gIR->context()), 2, "aa.samekey");
+    phi->addIncoming(DtoConstBool(false), lengthbb);
+    phi->addIncoming(sameContents, memcmpbb);
+    sameKey = phi;
+  } else {
+    sameKey = gIR->ir->CreateICmpEQ(entryKey, keyval, "aa.samekey");
+  }
+  gIR->ir->CreateCondBr(sameKey, foundbb, nextbb);
+
+  gIR->scope() = IRScope(emptybb);
+  gIR->ir->CreateCondBr(
+      gIR->ir->CreateICmpEQ(bucketHash, DtoConstSize_t(0)), endbb, nextbb);
+
+  gIR->scope() = IRScope(nextbb);
+  i->addIncoming(gIR->ir->CreateAnd(gIR->ir->CreateAdd(i, j), mask), nextbb);
+  j->addIncoming(gIR->ir->CreateAdd(j, DtoConstSize_t(1)), nextbb);
+  llvm::BranchInst::Create(loopbb, nextbb);
+
+  // the value follows the key, aligned like in rt.aaA.Impl.valoff
+  gIR->scope() = IRScope(foundbb);
+  uint64_t valueAlign = aatype->next->alignsize();
+  uint64_t valueOffset =
+      (keyType->size() + valueAlign - 1) & ~(valueAlign - 1);
+  LLValue *value = DtoGEPi1(entry, valueOffset, "aa.value");
+  llvm::BranchInst::Create(endbb, foundbb);
+
+  gIR->scope() = IRScope(endbb);
+  llvm::PHINode *res = gIR->ir->CreatePHI(getVoidPtrType(), 3, "aa.lookup");
+  res->addIncoming(getNullPtr(getVoidPtrType()), entrybb);
+  res->addIncoming(getNullPtr(getVoidPtrType()), emptybb);
+  res->addIncoming(value, foundbb);
+  return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static LLValue *DtoAAIndexCall(Loc &loc, Type *type, DValue *aa, DValue *key,
+                               bool lvalue) {
   // first get the runtime function
   llvm::Function *func = getRuntimeFunction(
       loc, gIR->module, lvalue ? "_aaGetY" : "_aaInX");
@@ -54,19 +271,35 @@ DValue *DtoAAIndex(Loc &loc, Type *type, DValue *aa, DValue *key, bool lvalue) {
   pkey = DtoBitCast(pkey, funcTy->getParamType(lvalue ? 3 : 2));
 
   // call runtime
-  LLValue *ret;
   if (lvalue) {
     LLValue *rawAATI =
         DtoTypeInfoOf(aa->type->unSharedOf()->mutableOf(), false);
     LLValue *castedAATI = DtoBitCast(rawAATI, funcTy->getParamType(1));
     LLValue *valsize = DtoConstSize_t(getTypeAllocSize(DtoType(type)));
-    ret = gIR->CreateCallOrInvoke(func, aaval, castedAATI, valsize, pkey,
-                                  "aa.index")
-              .getInstruction();
-  } else {
-    LLValue *keyti = DtoBitCast(to_keyti(aa), funcTy->getParamType(1));
-    ret = gIR->CreateCallOrInvoke(func, aaval, keyti, pkey, "aa.index")
-              .getInstruction();
+    return gIR->CreateCallOrInvoke(func, aaval, castedAATI, valsize, pkey,
+                                   "aa.index")
+        .getInstruction();
+  }
+
+  LLValue *keyti = DtoBitCast(to_keyti(aa), funcTy->getParamType(1));
+  return gIR->CreateCallOrInvoke(func, aaval, keyti, pkey, "aa.index")
+      .getInstruction();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+DValue *DtoAAIndex(Loc &loc, Type *type, DValue *aa, DValue *key, bool lvalue) {
+  // D2:
+  // call:
+  // extern(C) void* _aaGetY(AA* aa, TypeInfo aati, size_t valuesize, void*
+  // pkey)
+  // or
+  // extern(C) void* _aaInX(AA aa*, TypeInfo keyti, void* pkey)
+  // or with -aa-inline-lookup an inline probe for rvalues
+
+  LLValue *ret = lvalue ? nullptr : DtoAAInlineLookup(loc, aa, key);
+  if (!ret) {
+    ret = DtoAAIndexCall(loc, type, aa, key, lvalue);
   }
 
   // cast return value
@@ -116,6 +349,11 @@ DValue *DtoAAIn(Loc &loc, Type *type, DValue *aa, DValue *key) {
   // D2:
   // call:
   // extern(C) void* _aaInX(AA aa*, TypeInfo keyti, void* pkey)
+  // or with -aa-inline-lookup an inline probe
+
+  if (LLValue *ret = DtoAAInlineLookup(loc, aa, key)) {
+    return new DImValue(type, DtoBitCast(ret, DtoType(type)));
+  }
 
   // first get the runtime function
   llvm::Function *func = getRuntimeFunction(loc, gIR->module, "_aaInX");
@@ -933,10 +933,123 @@ static LLValue *DtoArrayEqCmp_impl(Loc &loc, const char *func, DValue *l,
   return gIR->func()->scopes->callOrInvoke(fn, args).getInstruction();
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Returns the element type shared by both arrays if their contents can be
+// compared with memcmp, i.e. if two elements are equal iff their bits are, or
+// nullptr.
+static Type *getMemcmpElementType(DValue *l, DValue *r) {
+  Type *lelem = l->getType()->toBasetype()->nextOf()->toBasetype();
+  Type *relem = r->getType()->toBasetype()->nextOf()->toBasetype();
+  if (!lelem->mutableOf()->unSharedOf()->equals(
+          relem->mutableOf()->unSharedOf())) {
+    return nullptr;
+  }
+
+  Type *t = lelem;
+  while (t->ty == Tsarray) {
+    t = t->nextOf()->toBasetype();
+  }
+
+  switch (t->ty) {
+  case Tvoid:
+  case Tint8:
+  case Tuns8:
+  case Tint16:
+  case Tuns16:
+  case Tint32:
+  case Tuns32:
+  case Tint64:
+  case Tuns64:
+  case Tint128:
+  case Tuns128:
+  case Tbool:
+  case Tchar:
+  case Twchar:
+  case Tdchar:
+  case Tpointer:
+    return lelem;
+  case Tstruct: {
+    // Without xopEquals TypeInfo_Struct.equals compares with memcmp as well
+    StructDeclaration *sd = static_cast<TypeStruct *>(t)->sym;
+    if (sd->semanticRun >= PASSsemanticdone && sd->sizeok == SIZEOKdone &&
+        !sd->xeq) {
+      return lelem;
+    }
+    return nullptr;
+  }
+  default:
+    return nullptr;
+  }
+}
+
+// Equal lengths, then memcmp the contents.
+static LLValue *DtoArrayEquals_memcmp(Loc &loc, DValue *l, DValue *r,
+                                      Type *elemType) {
+  IF_LOG Logger::println("comparing arrays with memcmp");
+
+  Type *commonType = l->getType()->toBasetype()->nextOf()->arrayOf();
+  l = DtoCastArray(loc, l, commonType);
+  r = DtoCastArray(loc, r, commonType);
+
+  LLValue *llen = DtoArrayLen(l);
+  LLValue *rlen = DtoArrayLen(r);
+  LLValue *sameLength = gIR->ir->CreateICmpEQ(llen, rlen, "arrayeq.lengths");
+
+  llvm::BasicBlock *lengthbb = gIR->scopebb();
+  llvm::BasicBlock *memcmpbb = llvm::BasicBlock::Create(
+      gIR->context(), "arrayeq.memcmp", gIR->topfunc());
+  llvm::BasicBlock *endbb =
+      llvm::BasicBlock::Create(gIR->context(), "arrayeq.end", gIR->topfunc());
+  gIR->ir->CreateCondBr(sameLength, memcmpbb, endbb);
+
+  gIR->scope() = IRScope(memcmpbb);
+  LLValue *size = gIR->ir->CreateMul(llen, DtoConstSize_t(elemType->size()));
+  LLValue *val = DtoMemCmp(DtoArrayPtr(l), DtoArrayPtr(r), size);
+  LLValue *sameContents = gIR->ir->CreateICmpEQ(
+      val, LLConstantInt::get(val->getType(), 0, false), "arrayeq.contents");
+  memcmpbb = gIR->scopebb();
+  llvm::BranchInst::Create(endbb, memcmpbb);
+
+  gIR->scope() = IRScope(endbb);
+  llvm::PHINode *res =
+      gIR->ir->CreatePHI(LLType::getInt1Ty(gIR->context()), 2, "arrayeq");
+  res->addIncoming(DtoConstBool(false), lengthbb);
+  res->addIncoming(sameContents, memcmpbb);
+  return res;
+}
+
+// memcmp the common prefix, then order by length. Only valid for unsigned
+// byte-sized elements.
+static LLValue *DtoArrayCompare_memcmp(Loc &loc, DValue *l, DValue *r) {
+  IF_LOG Logger::println("comparing arrays with memcmp");
+
+  Type *commonType = l->getType()->toBasetype()->nextOf()->arrayOf();
+  l = DtoCastArray(loc, l, commonType);
+  r = DtoCastArray(loc, r, commonType);
+
+  LLValue *llen = DtoArrayLen(l);
+  LLValue *rlen = DtoArrayLen(r);
+  LLValue *shorter = gIR->ir->CreateICmpULT(llen, rlen);
+  LLValue *longer = gIR->ir->CreateICmpUGT(llen, rlen);
+  LLValue *minlen = gIR->ir->CreateSelect(shorter, llen, rlen);
+
+  LLValue *val = DtoMemCmp(DtoArrayPtr(l), DtoArrayPtr(r), minlen);
+  LLValue *lengthOrder = gIR->ir->CreateSelect(
+      shorter, DtoConstInt(-1),
+      gIR->ir->CreateSelect(longer, DtoConstInt(1), DtoConstInt(0)));
+  LLValue *samePrefix = gIR->ir->CreateICmpEQ(val, DtoConstInt(0));
+  return gIR->ir->CreateSelect(samePrefix, lengthOrder, val, "arraycmp");
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 LLValue *DtoArrayEquals(Loc &loc, TOK op, DValue *l, DValue *r) {
-  LLValue *res = DtoArrayEqCmp_impl(loc, "_adEq2", l, r, true);
-  res = gIR->ir->CreateICmpNE(res, DtoConstInt(0));
+  LLValue *res;
+  if (Type *elemType = getMemcmpElementType(l, r)) {
+    res = DtoArrayEquals_memcmp(loc, l, r, elemType);
+  } else {
+    res = DtoArrayEqCmp_impl(loc, "_adEq2", l, r, true);
+    res = gIR->ir->CreateICmpNE(res, DtoConstInt(0));
+  }
   if (op == TOKnotequal) {
     res = gIR->ir->CreateNot(res);
   }
@@ -952,7 +1065,12 @@ LLValue *DtoArrayCompare(Loc &loc, TOK op, DValue *l, DValue *r) {
 
   if (!res) {
     Type *t = l->getType()->toBasetype()->nextOf()->toBasetype();
-    if (t->ty == Tchar) {
+    bool unsignedBytes =
+        (t->ty == Tchar || t->ty == Tuns8 || t->ty == Tvoid || t->ty == Tbool) &&
+        getMemcmpElementType(l, r);
+    if (unsignedBytes) {
+      res = DtoArrayCompare_memcmp(loc, l, r);
+    } else if (t->ty == Tchar) {
       res = DtoArrayEqCmp_impl(loc, "_adCmpChar", l, r, false);
     } else {
       res = DtoArrayEqCmp_impl(loc, "_adCmp2", l, r, true);
@@ -17,6 +17,7 @@ class ForeignCodeGen
 public:
     virtual void enterModule(::Module *m, llvm::Module *lm) = 0;
     virtual void leaveModule(::Module *m, llvm::Module *lm) = 0;
+    virtual void finishCodegen() = 0; // called once every module has been emitted
 
     virtual void enterFunc(FuncDeclaration *fd) = 0;
     virtual void leaveFunc() = 0;
@@ -435,8 +435,71 @@ DValue *DtoDynamicCastObject(Loc &loc, DValue *val, Type *_to) {
   cinfo = DtoBitCast(cinfo, funcTy->getParamType(1));
   assert(funcTy->getParamType(1) == cinfo->getType());
 
-  // call it
-  LLValue *ret = gIR->CreateCallOrInvoke(func, obj, cinfo).getInstruction();
+  // If the target is a D class, an object whose vtbl is the target's is
+  // exactly of the target class, and the cast succeeds without needing the
+  // runtime to walk the ClassInfo bases. If the target class is also final
+  // any other non-null object fails the cast.
+  ClassDeclaration *cd = to->sym;
+  bool exactCheck = !adfrom->langPlugin() && !cd->langPlugin() &&
+                    !cd->isInterfaceDeclaration() && !cd->isCPPclass() &&
+                    ClassDeclaration::object->isBaseOf2(cd);
+  if (!exactCheck) {
+    // call it
+    LLValue *ret = gIR->CreateCallOrInvoke(func, obj, cinfo).getInstruction();
+
+    // cast return value
+    ret = DtoBitCast(ret, DtoType(_to));
+
+    return new DImValue(_to, ret);
+  }
+
+  bool isFinal = (cd->storage_class & STCfinal) != 0;
+  LLValue *null = LLConstant::getNullValue(obj->getType());
+
+  llvm::BasicBlock *entrybb = gIR->scopebb();
+  llvm::BasicBlock *vtblbb =
+      llvm::BasicBlock::Create(gIR->context(), "cast.vtbl", gIR->topfunc());
+  llvm::BasicBlock *callbb =
+      isFinal ? nullptr : llvm::BasicBlock::Create(gIR->context(),
+                                                   "cast.call", gIR->topfunc());
+  llvm::BasicBlock *endbb =
+      llvm::BasicBlock::Create(gIR->context(), "cast.end", gIR->topfunc());
+
+  LLValue *isNull = gIR->ir->CreateICmpEQ(obj, null, ".nullcheck");
+  gIR->ir->CreateCondBr(isNull, endbb, vtblbb);
+
+  gIR->scope() = IRScope(vtblbb);
+  LLValue *vtbl = DtoLoad(DtoGEPi(DtoBitCast(obj, DtoType(_to)), 0, 0));
+  LLValue *targetVtbl = DtoBitCast(getIrAggr(cd)->getVtblSymbol(),
+                                   vtbl->getType());
+  LLValue *isExact = gIR->ir->CreateICmpEQ(vtbl, targetVtbl, ".exactcheck");
+  LLValue *ret;
+  if (isFinal) {
+    LLValue *exact = gIR->ir->CreateSelect(isExact, obj, null);
+    llvm::BranchInst::Create(endbb, vtblbb);
+
+    gIR->scope() = IRScope(endbb);
+    llvm::PHINode *phi = gIR->ir->CreatePHI(obj->getType(), 2, ".dyncast");
+    phi->addIncoming(null, entrybb);
+    phi->addIncoming(exact, vtblbb);
+    ret = phi;
+  } else {
+    gIR->ir->CreateCondBr(isExact, endbb, callbb);
+
+    gIR->scope() = IRScope(callbb);
+    LLValue *called =
+        gIR->CreateCallOrInvoke(func, obj, cinfo).getInstruction();
+    called = DtoBitCast(called, obj->getType());
+    callbb = gIR->scopebb();
+    llvm::BranchInst::Create(endbb, callbb);
+
+    gIR->scope() = IRScope(endbb);
+    llvm::PHINode *phi = gIR->ir->CreatePHI(obj->getType(), 3, ".dyncast");
+    phi->addIncoming(null, entrybb);
+    phi->addIncoming(obj, vtblbb);
+    phi->addIncoming(called, callbb);
+    ret = phi;
+  }
 
   // cast return value
   ret = DtoBitCast(ret, DtoType(_to));
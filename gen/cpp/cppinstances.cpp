@@ -0,0 +1,437 @@
+// Contributed by Elie Morisse, same license DMD uses
+#include "cpp/calypso.h"
+
+#include "driver/cl_options.h"
+#include "driver/toobj.h"
+#include "gen/logger.h"
+
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LockFileManager.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+namespace cpp
+{
+
+using llvm::cast;
+using llvm::dyn_cast;
+using llvm::isa;
+
+// Inline functions, template instantiations, their static variables and vtables are emitted by Clang with
+// linkonce_odr linkage in every module referencing them
+static bool isInstance(const llvm::GlobalValue &GV)
+{
+    if (!GV.hasLinkOnceODRLinkage() || GV.isDeclaration())
+        return false;
+
+    auto Name = GV.getName();
+    return Name.startswith("_Z") || Name.startswith("?"); // Itanium or MSVC mangling
+}
+
+static void dropDefinition(llvm::GlobalValue *GV)
+{
+    if (auto F = dyn_cast<llvm::Function>(GV))
+        F->deleteBody();
+    else if (auto Var = dyn_cast<llvm::GlobalVariable>(GV))
+    {
+        Var->setInitializer(nullptr);
+        Var->setLinkage(llvm::GlobalValue::ExternalLinkage);
+    }
+    else
+    {
+        auto GA = cast<llvm::GlobalAlias>(GV);
+        auto M = GA->getParent();
+
+        llvm::GlobalValue *Decl;
+        if (auto FTy = dyn_cast<llvm::FunctionType>(GA->getValueType()))
+            Decl = llvm::Function::Create(FTy, llvm::GlobalValue::ExternalLinkage, "", M);
+        else
+            Decl = new llvm::GlobalVariable(*M, GA->getValueType(), false,
+                                            llvm::GlobalValue::ExternalLinkage, nullptr);
+
+        Decl->takeName(GA);
+        GA->replaceAllUsesWith(llvm::ConstantExpr::getBitCast(Decl, GA->getType()));
+        GA->eraseFromParent();
+        return;
+    }
+
+    GV->setComdat(nullptr);
+}
+
+template<typename Fn>
+static void forEachGlobalValue(llvm::Module &M, Fn fn)
+{
+    for (auto I = M.begin(), E = M.end(); I != E;)
+        fn(&*I++);
+    for (auto I = M.global_begin(), E = M.global_end(); I != E;)
+        fn(&*I++);
+    for (auto I = M.alias_begin(), E = M.alias_end(); I != E;)
+        fn(&*I++);
+}
+
+// Each object file records the instances it uses into named metadata of the instances module, so that the ones no
+// object file needs anymore get pruned instead of piling up in the cache
+static const char *InstanceUsersMD = "calypso.instance_users";
+
+static void setInstanceUsers(llvm::Module &M, llvm::StringRef objFilename, const llvm::StringSet<> &Names)
+{
+    auto& Ctx = M.getContext();
+
+    llvm::SmallVector<llvm::MDNode*, 16> Users;
+    if (auto NMD = M.getNamedMetadata(InstanceUsersMD))
+    {
+        for (unsigned i = 0; i < NMD->getNumOperands(); i++)
+        {
+            auto User = NMD->getOperand(i);
+            if (cast<llvm::MDString>(User->getOperand(0))->getString() != objFilename)
+                Users.push_back(User);
+        }
+        NMD->eraseFromParent();
+    }
+
+    if (!Names.empty())
+    {
+        llvm::SmallVector<llvm::Metadata*, 64> Ops;
+        Ops.push_back(llvm::MDString::get(Ctx, objFilename));
+        for (auto& Entry: Names)
+            Ops.push_back(llvm::MDString::get(Ctx, Entry.getKey()));
+        Users.push_back(llvm::MDNode::get(Ctx, Ops));
+    }
+
+    auto NMD = M.getOrInsertNamedMetadata(InstanceUsersMD);
+    for (auto User: Users)
+        NMD->addOperand(User);
+}
+
+// Drop the users whose object file is gone, unless it's going to be written by this compilation (e.g -singleobj),
+// then the instances none of the remaining users needs
+static void pruneInstances(llvm::Module &M, const llvm::StringMap<llvm::StringSet<>> &NewUsers)
+{
+    auto NMD = M.getNamedMetadata(InstanceUsersMD);
+    if (!NMD)
+        return; // written by an older version, nothing is known about the users
+
+    llvm::StringSet<> Used;
+    llvm::SmallVector<llvm::MDNode*, 16> Users;
+    for (unsigned i = 0; i < NMD->getNumOperands(); i++)
+    {
+        auto User = NMD->getOperand(i);
+        auto objFilename = cast<llvm::MDString>(User->getOperand(0))->getString();
+        if (!NewUsers.count(objFilename) && !llvm::sys::fs::exists(objFilename))
+            continue;
+
+        Users.push_back(User);
+        for (unsigned j = 1; j < User->getNumOperands(); j++)
+            Used.insert(cast<llvm::MDString>(User->getOperand(j))->getString());
+    }
+
+    NMD->dropAllReferences();
+    for (auto User: Users)
+        NMD->addOperand(User);
+
+    // The unused instances become discardable, and GlobalDCE erases them unless a used one still references them
+    forEachGlobalValue(M, [&] (llvm::GlobalValue *GV) {
+        if (!GV->isDeclaration() && GV->hasWeakODRLinkage() && !Used.count(GV->getName()))
+            GV->setLinkage(llvm::GlobalValue::LinkOnceODRLinkage);
+    });
+
+    llvm::legacy::PassManager PM;
+    PM.add(llvm::createGlobalDCEPass());
+    PM.run(M);
+
+    forEachGlobalValue(M, [&] (llvm::GlobalValue *GV) {
+        if (GV->hasLinkOnceODRLinkage())
+            GV->setLinkage(llvm::GlobalValue::WeakODRLinkage);
+    });
+}
+
+// When linking or creating a library __cpp_instances.o stays in the cache directory, but with -c nothing would pick it up
+// from there so it's emitted as a regular output next to the other object files, to be linked along with them.
+static std::string getInstancesObjFilename()
+{
+    llvm::SmallString<128> objFilename;
+    if (global.params.link || opts::createStaticLib)
+        objFilename = opts::cppCacheDir;
+    else if (global.params.objdir)
+        objFilename = global.params.objdir;
+    llvm::sys::path::append(objFilename, "__cpp_instances");
+    llvm::sys::path::replace_extension(objFilename,
+            global.params.targetTriple.isOSWindows() ? global.obj_ext_alt : global.obj_ext);
+    return objFilename.str();
+}
+
+static std::unique_ptr<llvm::Module> readInstancesModule(const std::string &bcFilename, llvm::LLVMContext &Ctx)
+{
+    if (!llvm::sys::fs::exists(bcFilename))
+        return nullptr;
+
+    auto Buffer = llvm::MemoryBuffer::getFile(bcFilename);
+    if (Buffer)
+    {
+        auto M = llvm::parseBitcodeFile((*Buffer)->getMemBufferRef(), Ctx);
+        if (M)
+            return std::move(*M);
+    }
+
+    IF_LOG Logger::println("Discarding unreadable %s", bcFilename.c_str());
+    return nullptr;
+}
+
+// The instances emitted by this compilation are collected into a module of their own, and only merged into the cached
+// one by finishCodegen() once the cache lock is held
+llvm::Module *LangPlugin::getInstancesModule(llvm::LLVMContext &Ctx)
+{
+    if (!InstancesModule)
+        InstancesModule.reset(new llvm::Module("__cpp_instances", Ctx));
+
+    return InstancesModule.get();
+}
+
+// Move the C++ instances emitted into lm over to the instances module, and leave available_externally copies behind so
+// that each one only gets compiled once per compilation.
+void LangPlugin::extractInstances(::Module *m, llvm::Module *lm)
+{
+    llvm::StringSet<> Names;
+    forEachGlobalValue(*lm, [&] (llvm::GlobalValue *GV) {
+        if (isInstance(*GV))
+            Names.insert(GV->getName());
+    });
+
+    auto objFilename = m->objfile->name->str;
+    if (Names.empty())
+    {
+        // The object file might have needed instances the last time it was compiled
+        if (InstancesModule || llvm::sys::fs::exists(getCacheFilename(".instances.bc")))
+        {
+            NewInstanceUsers[objFilename].clear();
+            instancesModified = true;
+        }
+        return;
+    }
+
+    auto Dest = getInstancesModule(lm->getContext());
+    if (Dest->getTargetTriple().empty())
+    {
+        Dest->setTargetTriple(lm->getTargetTriple());
+        Dest->setDataLayout(lm->getDataLayout());
+    }
+
+    // Strip everything that isn't an instance or a local symbol it might reference from a copy of lm
+    auto Src = llvm::CloneModule(lm);
+
+    for (auto Name: { "llvm.global_ctors", "llvm.global_dtors", "llvm.used", "llvm.compiler.used" })
+        if (auto GV = Src->getNamedGlobal(Name))
+            GV->eraseFromParent();
+
+    forEachGlobalValue(*Src, [&] (llvm::GlobalValue *GV) {
+        if (Names.count(GV->getName()))
+        {
+            // weak_odr so that the instances survive GlobalDCE and make it into the object file
+            GV->setLinkage(llvm::GlobalValue::WeakODRLinkage);
+            if (auto GO = dyn_cast<llvm::GlobalObject>(GV))
+                GO->setComdat(nullptr);
+        }
+        else if (!GV->isDeclaration() && !GV->hasLocalLinkage())
+            dropDefinition(GV);
+    });
+
+    llvm::legacy::PassManager PM;
+    PM.add(llvm::createGlobalDCEPass());
+    PM.run(*Src);
+
+    // The definitions coming from the module we just generated are the up-to-date ones
+    for (auto& Entry: Names)
+        if (auto GV = Dest->getNamedValue(Entry.getKey()))
+            if (!GV->isDeclaration())
+                dropDefinition(GV);
+
+    if (llvm::Linker::linkModules(*Dest, std::move(Src)))
+    {
+        ::error(Loc(), "Linking C++ instances into __cpp_instances failed");
+        fatal();
+    }
+    // The bodies stay available to the optimizer of lm so that small inline functions still get inlined, but none of
+    // them gets emitted into its object file
+    for (auto& Entry: Names)
+    {
+        auto GV = lm->getNamedValue(Entry.getKey());
+        if (isa<llvm::GlobalAlias>(GV))
+        {
+            dropDefinition(GV); // aliases can't be available_externally
+            continue;
+        }
+
+        GV->setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+        cast<llvm::GlobalObject>(GV)->setComdat(nullptr);
+    }
+
+    NewInstanceUsers[objFilename] = std::move(Names);
+    instancesModified = true;
+}
+
+// The object file is emitted under a temporary name then renamed into place, since the linker of another ldc2 process
+// may be reading the current one. The other outputs requested (-output-ll, ...) are renamed along with it.
+static void writeInstancesObj(llvm::Module *M, const std::string &objFilename)
+{
+    llvm::SmallString<128> TmpModel(objFilename), TmpPath;
+    llvm::sys::path::replace_extension(TmpModel, "");
+    TmpModel += "-%%%%%%%%";
+    TmpModel += llvm::sys::path::extension(objFilename);
+
+    if (auto EC = llvm::sys::fs::createUniqueFile(TmpModel, TmpPath))
+    {
+        ::error(Loc(), "Writing %s failed: %s", objFilename.c_str(), EC.message().c_str());
+        fatal();
+    }
+    ::writeModule(M, TmpPath.str());
+
+    struct { bool requested; const char *ext; } Outputs[] = {
+        { global.params.output_o, nullptr },
+        { global.params.output_bc, global.bc_ext },
+        { global.params.output_ll, global.ll_ext },
+        { global.params.output_s, global.s_ext }
+    };
+
+    for (auto& Output: Outputs)
+    {
+        if (!Output.requested)
+            continue;
+
+        llvm::SmallString<128> From(TmpPath), To(objFilename);
+        if (Output.ext)
+        {
+            llvm::sys::path::replace_extension(From, Output.ext);
+            llvm::sys::path::replace_extension(To, Output.ext);
+        }
+
+        if (auto EC = llvm::sys::fs::rename(From, To))
+        {
+            llvm::sys::fs::remove(From);
+            ::error(Loc(), "Writing %s failed: %s", To.c_str(), EC.message().c_str());
+            fatal();
+        }
+    }
+
+    if (!global.params.output_o)
+        llvm::sys::fs::remove(TmpPath); // the empty file created by createUniqueFile
+}
+
+void LangPlugin::finishCodegen()
+{
+    if (!opts::cppDedupInstances || !getASTUnit())
+        return;
+
+    auto objFilename = getInstancesObjFilename();
+    auto bcFilename = getCacheFilename(".instances.bc");
+
+    // None of the modules emitted this time contained C++ instances, but the cached objects may need them
+    if (!instancesModified && !llvm::sys::fs::exists(bcFilename))
+        return;
+
+    // The object file may also have been compiled from an older instances module if it isn't in the cache directory
+    auto isUpToDate = [&] {
+        llvm::sys::fs::file_status objStatus, bcStatus;
+        return !llvm::sys::fs::status(objFilename, objStatus) &&
+                !llvm::sys::fs::status(bcFilename, bcStatus) &&
+                objStatus.getLastModificationTime() >= bcStatus.getLastModificationTime();
+    };
+
+    if (!instancesModified && isUpToDate())
+    {
+        global.params.objfiles->push(strdup(objFilename.c_str()));
+        return;
+    }
+
+    // Other ldc2 processes may be updating the cached instances module too, so it's read, merged and written back
+    // under the same lock update() takes to regenerate the PCH
+    std::unique_ptr<llvm::LockFileManager> Lock;
+    while (true)
+    {
+        Lock.reset(new llvm::LockFileManager(getCacheFilename(".h.pch")));
+        if (Lock->getState() != llvm::LockFileManager::LFS_Shared)
+            break;
+
+        if (Lock->waitForUnlock() == llvm::LockFileManager::Res_Timeout)
+        {
+            Lock.reset(); // go on without, the cache files are still replaced atomically
+            break;
+        }
+    }
+
+    auto& Ctx = InstancesModule ? InstancesModule->getContext() : llvm::getGlobalContext();
+    auto Cached = readInstancesModule(bcFilename, Ctx);
+
+    if (!Cached)
+    {
+        Cached.reset(new llvm::Module("__cpp_instances", Ctx));
+        instancesModified = true;
+    }
+
+    if (InstancesModule)
+    {
+        if (Cached->getTargetTriple().empty())
+        {
+            Cached->setTargetTriple(InstancesModule->getTargetTriple());
+            Cached->setDataLayout(InstancesModule->getDataLayout());
+        }
+
+        // The definitions coming from this compilation are the up-to-date ones
+        forEachGlobalValue(*InstancesModule, [&] (llvm::GlobalValue *GV) {
+            if (GV->isDeclaration())
+                return;
+            if (auto Old = Cached->getNamedValue(GV->getName()))
+                if (!Old->isDeclaration())
+                    dropDefinition(Old);
+        });
+
+        if (llvm::Linker::linkModules(*Cached, std::move(InstancesModule)))
+        {
+            ::error(Loc(), "Linking C++ instances into __cpp_instances failed");
+            fatal();
+        }
+    }
+
+    for (auto& User: NewInstanceUsers)
+        setInstanceUsers(*Cached, User.getKey(), User.getValue());
+
+    if (instancesModified)
+    {
+        pruneInstances(*Cached, NewInstanceUsers);
+
+        // Written to a temporary file then renamed, since other ldc2 processes may be reading it without the lock
+        int FD;
+        llvm::SmallString<128> TmpPath;
+        auto EC = llvm::sys::fs::createUniqueFile(bcFilename + "-%%%%%%%%", FD, TmpPath);
+        if (!EC)
+        {
+            llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+            llvm::WriteBitcodeToFile(Cached.get(), OS);
+            OS.close();
+            EC = llvm::sys::fs::rename(TmpPath, bcFilename);
+        }
+        if (EC)
+        {
+            llvm::sys::fs::remove(TmpPath);
+            ::error(Loc(), "Writing %s failed: %s", bcFilename.c_str(), EC.message().c_str());
+            fatal();
+        }
+    }
+
+    writeInstancesObj(Cached.get(), objFilename);
+    global.params.objfiles->push(strdup(objFilename.c_str()));
+
+    NewInstanceUsers.clear();
+    instancesModified = false;
+}
+
+}
@@ -6,6 +6,7 @@
 
 #include "mtype.h"
 #include "target.h"
+#include "driver/cl_options.h"
 #include "gen/dvalue.h"
 #include "gen/functions.h"
 #include "gen/logger.h"
@@ -51,27 +52,55 @@ using llvm::isa;
 
 namespace clangCG = clang::CodeGen;
 
-void LangPlugin::enterModule(::Module *, llvm::Module *lm)
+void CodeGenSession::retarget(llvm::Module *lm)
 {
-    auto AST = getASTUnit();
-    if (!AST)
-        return;
+    assert(!CGM);
+    TargetModule = lm;
+}
 
-    pch.save(); // save the numerous instantiations done by DMD back into the PCH
+void CodeGenSession::create()
+{
+    assert(TargetModule);
 
-    auto& Context = getASTContext();
+    auto AST = calypso.getASTUnit();
+    auto& Context = calypso.getASTContext();
 
-    auto Opts = new clang::CodeGenOptions;
-    if (global.params.symdebug)
-        Opts->setDebugInfo(clang::CodeGenOptions::FullDebugInfo);
+    if (!Opts)
+    {
+        Opts.reset(new clang::CodeGenOptions);
+        if (global.params.symdebug)
+            Opts->setDebugInfo(clang::CodeGenOptions::FullDebugInfo);
+    }
 
     CGM.reset(new clangCG::CodeGenModule(Context,
                             AST->getPreprocessor().getHeaderSearchInfo().getHeaderSearchOpts(),
                             AST->getPreprocessor().getPreprocessorOpts(),
-                            *Opts, *lm, *pch.Diags));
+                            *Opts, *TargetModule, *calypso.pch.Diags));
     if (!RecordDeclTypes.empty())
         // restore the CodeGenTypes state, to prevent Clang from recreating types that end up different from the ones LDC knows
         CGM->getTypes().swapTypeCache(CGRecordLayouts, RecordDeclTypes, TypeCache);
+}
+
+void CodeGenSession::release()
+{
+    if (!CGM)
+        return;
+
+    CGM->getTypes().swapTypeCache(CGRecordLayouts, RecordDeclTypes, TypeCache); // save the CodeGenTypes state
+    CGM.reset();
+    InternalDeclsVisited.clear();
+    CallFunctionInfos.clear();
+}
+
+void LangPlugin::enterModule(::Module *, llvm::Module *lm)
+{
+    auto AST = getASTUnit();
+    if (!AST)
+        return;
+
+    pch.save(); // save the numerous instantiations done by DMD back into the PCH
+
+    CGM.retarget(lm);
 
     type_infoWrappers.clear();
     EmittedStaticVars.clear();
@@ -123,6 +152,13 @@ void LangPlugin::leaveModule(::Module *m, llvm::Module *lm)
     if (!getASTUnit())
         return;
 
+    if (!CGM) // no C++ declaration was needed by this module
+    {
+        if (!global.errors && isCPP(m))
+            calypso.genModSet.add(m);
+        return;
+    }
+
     // HACK temporarily rename the @llvm.global_ctors and @llvm.global_dtors variables created by LDC,
     // because CodeGenModule::Release will assume that they do not exist and use the same name, which LLVM will change to an unused one.
     auto ldcCtor = lm->getNamedGlobal("llvm.global_ctors"),
@@ -186,8 +222,10 @@ void LangPlugin::leaveModule(::Module *m, llvm::Module *lm)
     // HACK Check and remove duplicate module flags such as "Debug Info Version" created by both Clang and LDC
     removeDuplicateModuleFlags(lm);
 
-    CGM->getTypes().swapTypeCache(CGRecordLayouts, RecordDeclTypes, TypeCache); // save the CodeGenTypes state
-    CGM.reset();
+    if (opts::cppDedupInstances)
+        extractInstances(m, lm);
+
+    CGM.release();
 
     if (!global.errors && isCPP(m))
         calypso.genModSet.add(m);
@@ -200,21 +238,34 @@ void LangPlugin::enterFunc(::FuncDeclaration *fd)
 
     IrFunction *irFunc = getIrFunc(fd);
 
-    CGFStack.push(new clangCG::CodeGenFunction(*CGM, true));
-    CGF()->CurCodeDecl = nullptr;
-    CGF()->AllocaInsertPt = irFunc->allocapoint;
+    CGFStack.push({nullptr, irFunc->allocapoint});
 }
 
 void LangPlugin::leaveFunc()
 {
     if (!getASTUnit())
         return;
-    
-    CGF()->AllocaInsertPt = nullptr;
-    delete CGF();
+
+    if (auto CGF = CGFStack.top().first)
+    {
+        CGF->AllocaInsertPt = nullptr;
+        delete CGF;
+    }
     CGFStack.pop();
 }
 
+clangCG::CodeGenFunction *LangPlugin::CGF()
+{
+    auto& Top = CGFStack.top();
+    if (!Top.first)
+    {
+        Top.first = new clangCG::CodeGenFunction(*CGM, true);
+        Top.first->CurCodeDecl = nullptr;
+        Top.first->AllocaInsertPt = Top.second;
+    }
+    return Top.first;
+}
+
 void LangPlugin::updateCGFInsertPoint()
 {
     auto BB = gIR->scope().begin;
@@ -521,14 +572,22 @@ DValue *LangPlugin::adjustForDynamicCast(Loc &loc, DValue *val, Type *_to)
 
 bool LangPlugin::toIsReturnInArg(CallExp* ce)
 {
+    auto& CI = CallInfos[ce->f];
+    if (CI.ReturnInArg != -1)
+        return CI.ReturnInArg;
+
     auto FD = getFD(ce->f);
     if (isa<clang::CXXConstructorDecl>(FD) || isa<clang::CXXDestructorDecl>(FD))
-        return false;
+        CI.ReturnInArg = false;
+    else
+    {
+        auto& fnInfo = CGM->getTypes().arrangeFunctionDeclaration(FD);
+        auto& RetAI = fnInfo.getReturnInfo();
 
-    auto& fnInfo = CGM->getTypes().arrangeFunctionDeclaration(FD);
-    auto& RetAI = fnInfo.getReturnInfo();
+        CI.ReturnInArg = RetAI.isIndirect() || RetAI.isInAlloca();
+    }
 
-    return RetAI.isIndirect() || RetAI.isInAlloca();
+    return CI.ReturnInArg;
 }
 
 LLValue *LangPlugin::toVirtualFunctionPointer(DValue* inst, 
@@ -570,11 +629,11 @@ class InternalDeclEmitter : public clang::RecursiveASTVisitor<InternalDeclEmitte
     clang::ASTContext &Context;
     clangCG::CodeGenModule &CGM;
 
-    llvm::DenseSet<const clang::Decl *> Emitted;
+    llvm::DenseSet<const clang::Decl *> &Emitted; // the closure of a function only needs to be walked once per module
 
 public:
     InternalDeclEmitter(clang::ASTContext &Context,
-                        clangCG::CodeGenModule &CGM) : Context(Context), CGM(CGM) {}
+                        CodeGenSession &Session) : Context(Context), CGM(*Session), Emitted(Session.InternalDeclsVisited) {}
     bool Emit(const clang::FunctionDecl *Callee);
     void Traverse(const clang::FunctionDecl *Def);
 
@@ -678,7 +737,7 @@ DValue* LangPlugin::toCallFunction(Loc& loc, Type* resulttype, DValue* fnval,
     auto FD = getFD(fd);
     auto MD = dyn_cast<const clang::CXXMethodDecl>(FD);
 
-    InternalDeclEmitter(Context, *CGM).Emit(FD);
+    InternalDeclEmitter(Context, CGM).Emit(FD);
 
     auto ThisVal = MD ? dfnval->vthis : nullptr;
     clangCG::Address This(ThisVal, clang::CharUnits::One());
@@ -705,14 +764,27 @@ DValue* LangPlugin::toCallFunction(Loc& loc, Type* resulttype, DValue* fnval,
     }
 
     size_t n = Parameter::dim(tf->parameters);
+
+    auto& CI = CallInfos[fd];
+    if (!CI.hasArgTypes)
+    {
+        TypeMapper tymap;
+        for (size_t i=0; i<n; ++i) {
+            Parameter* fnarg = Parameter::getNth(tf->parameters, i);
+            CI.ArgTypes.push_back(tymap.toType(loc, fnarg->type,
+                                        fd->scope, fnarg->storageClass));
+        }
+        CI.hasArgTypes = true;
+    }
+    auto ArgTypes = CI.ArgTypes; // CI may move, the arguments might contain C++ calls as well
+
     for (size_t i=0; i<n; ++i) {
         Parameter* fnarg = Parameter::getNth(tf->parameters, i);
         assert(fnarg);
         DValue* argval = DtoArgument(fnarg, arguments->data[i]);
 
         auto argty = fnarg->type;
-        auto ArgTy = TypeMapper().toType(loc, argty,
-                                        fd->scope, fnarg->storageClass);
+        auto ArgTy = ArgTypes[i];
         if ((argty->ty == Tstruct || isClassValue(argty)) && !(fnarg->storageClass & STCref))
         {
 //             llvm::Value *tmp = CGF()->CreateMemTemp(type);
@@ -755,8 +827,11 @@ DValue* LangPlugin::toCallFunction(Loc& loc, Type* resulttype, DValue* fnval,
 
     updateCGFInsertPoint(); // emitLandingPad() may have run the cleanups and call C++ dtors, hence changing the insert point
 
-    auto &FInfo = arrangeFunctionCall(CGM.get(), FD, Args);
-    RV = CGF()->EmitCall(FInfo, callable, ReturnValue, Args, FD,
+    // The arrangement only depends on the argument types, which are the same for every call to fd
+    auto& FInfo = CGM.CallFunctionInfos[fd];
+    if (!FInfo)
+        FInfo = &arrangeFunctionCall(CGM.get(), FD, Args);
+    RV = CGF()->EmitCall(*FInfo, callable, ReturnValue, Args, FD,
                             nullptr, invokeDest, postinvoke);
 
     if (postinvoke)
@@ -826,7 +901,7 @@ void LangPlugin::toDefineFunction(::FuncDeclaration* fdecl)
         CGM->EmitTopLevelDecl(const_cast<clang::FunctionDecl*>(Def)); // TODO remove const_cast
 
         // Emit inline functions this function depends upon
-        InternalDeclEmitter(Context, *CGM).Traverse(Def);
+        InternalDeclEmitter(Context, CGM).Traverse(Def);
     }
 }
 
@@ -944,7 +1019,7 @@ void LangPlugin::EmitInternalDeclsForFields(const clang::RecordDecl *RD)
     auto& Context = getASTContext();
     auto& S = getSema();
 
-    InternalDeclEmitter Emitter(Context, *CGM);
+    InternalDeclEmitter Emitter(Context, CGM);
 
     auto Emit = [&] (clang::CXXMethodDecl *D) {
         if (D && !D->isDeleted())
@@ -301,6 +301,12 @@ static void addOptimizationPasses(PassManagerBase &mpm,
 // This function runs optimization passes based on command line arguments.
 // Returns true if any optimization passes were invoked.
 bool ldc_optimize_module(llvm::Module *M) {
+  return ldc_optimize_module(M, *gTargetMachine);
+}
+
+// Same as above, with the target machine passed explicitly so that modules can
+// be optimized concurrently, each thread using its own.
+bool ldc_optimize_module(llvm::Module *M, llvm::TargetMachine &target) {
 // Create a PassManager to hold and optimize the collection of
 // per-module passes we are about to build.
 #if LDC_LLVM_VER >= 307
@@ -348,10 +354,10 @@ bool ldc_optimize_module(llvm::Module *M) {
 #if LDC_LLVM_VER >= 307
   // Add internal analysis passes from the target machine.
   mpm.add(createTargetTransformInfoWrapperPass(
-      gTargetMachine->getTargetIRAnalysis()));
+      target.getTargetIRAnalysis()));
 #else
   // Add internal analysis passes from the target machine.
-  gTargetMachine->addAnalysisPasses(mpm);
+  target.addAnalysisPasses(mpm);
 #endif
 
 // Also set up a manager for the per-function passes.
@@ -363,13 +369,13 @@ bool ldc_optimize_module(llvm::Module *M) {
 #if LDC_LLVM_VER >= 307
   // Add internal analysis passes from the target machine.
   fpm.add(createTargetTransformInfoWrapperPass(
-      gTargetMachine->getTargetIRAnalysis()));
+      target.getTargetIRAnalysis()));
 #elif LDC_LLVM_VER >= 306
   fpm.add(new DataLayoutPass());
-  gTargetMachine->addAnalysisPasses(fpm);
+  target.addAnalysisPasses(fpm);
 #else
                                     fpm.add(new DataLayoutPass(M));
-                                    gTargetMachine->addAnalysisPasses(fpm);
+                                    target.addAnalysisPasses(fpm);
 #endif
 
   // If the -strip-debug command line option was specified, add it before
@@ -27,6 +27,7 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/CallSite.h"
+#include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Analysis/CallGraph.h"
 #include "llvm/IR/Dominators.h"
@@ -460,10 +461,20 @@ static void RemoveCall(CallSite CS, const Analysis &A) {
 
 static bool
 isSafeToStackAllocateArray(BasicBlock::iterator Alloc, DominatorTree &DT,
-                           SmallVector<CallInst *, 4> &RemoveTailCallInsts);
+                           SmallVector<CallInst *, 4> &RemoveTailCallInsts,
+                           const char *&Reason);
 static bool
 isSafeToStackAllocate(BasicBlock::iterator Alloc, Value *V, DominatorTree &DT,
-                      SmallVector<CallInst *, 4> &RemoveTailCallInsts);
+                      SmallVector<CallInst *, 4> &RemoveTailCallInsts,
+                      const char *&Reason);
+
+// Reports why an allocation wasn't promoted with -pass-remarks-missed=dgc2stack
+static void emitMissedRemark(Function &F, Instruction *Inst, const Twine &Msg) {
+  emitOptimizationRemarkMissed(F.getContext(), DEBUG_TYPE, F,
+                               Inst->getDebugLoc(),
+                               "GC allocation not promoted to the stack: " +
+                                   Msg);
+}
 
 /// runOnFunction - Top level algorithm.
 ///
@@ -528,20 +539,31 @@ bool GarbageCollect2Stack::runOnFunction(Function &F) {
       DEBUG(errs() << "GarbageCollect2Stack inspecting: " << *Inst);
 
       if (!info->analyze(CS, A)) {
+        emitMissedRemark(F, Inst, "type unknown or size not known to be below "
+                                  "-dgc2stack-size-limit");
         continue;
       }
 
       SmallVector<CallInst *, 4> RemoveTailCallInsts;
+      const char *Reason = nullptr;
       if (info->ReturnType == ReturnType::Array) {
-        if (!isSafeToStackAllocateArray(originalI, DT, RemoveTailCallInsts)) {
+        if (!isSafeToStackAllocateArray(originalI, DT, RemoveTailCallInsts,
+                                        Reason)) {
+          emitMissedRemark(F, Inst, Reason);
           continue;
         }
       } else {
-        if (!isSafeToStackAllocate(originalI, Inst, DT, RemoveTailCallInsts)) {
+        if (!isSafeToStackAllocate(originalI, Inst, DT, RemoveTailCallInsts,
+                                   Reason)) {
+          emitMissedRemark(F, Inst, Reason);
           continue;
         }
       }
 
+      emitOptimizationRemark(F.getContext(), DEBUG_TYPE, F,
+                             Inst->getDebugLoc(),
+                             "GC allocation promoted to the stack");
+
       // Let's alloca this!
       Changed = true;
 
@@ -613,6 +635,14 @@ Type *Analysis::getTypeFor(Value *typeinfo) const {
 #endif
 }
 
+/// Returns whether Prefix is equal to or a prefix of Indices, i.e. whether it
+/// designates the aggregate member at Indices or one of its enclosing members.
+static bool isIndexPrefix(ArrayRef<unsigned> Prefix,
+                          ArrayRef<unsigned> Indices) {
+  return Prefix.size() <= Indices.size() &&
+         Prefix == Indices.slice(0, Prefix.size());
+}
+
 /// Returns whether Def is used by any instruction that is reachable from Alloc
 /// (without executing Def again).
 static bool mayBeUsedAfterRealloc(Instruction *Def, BasicBlock::iterator Alloc,
@@ -760,7 +790,7 @@ static bool mayBeUsedAfterRealloc(Instruction *Def, BasicBlock::iterator Alloc,
 /// see isSafeToStackAllocate() for details.
 bool isSafeToStackAllocateArray(
     BasicBlock::iterator Alloc, DominatorTree &DT,
-    SmallVector<CallInst *, 4> &RemoveTailCallInsts) {
+    SmallVector<CallInst *, 4> &RemoveTailCallInsts, const char *&Reason) {
   assert(Alloc->getType()->isStructTy() && "Allocated array is not a struct?");
   Value *V = &(*Alloc);
 
@@ -782,7 +812,8 @@ bool isSafeToStackAllocateArray(
                "First array field not length?");
       } else {
         assert(idx == 1 && "Invalid array struct access.");
-        if (!isSafeToStackAllocate(Alloc, EVI, DT, RemoveTailCallInsts)) {
+        if (!isSafeToStackAllocate(Alloc, EVI, DT, RemoveTailCallInsts,
+                                   Reason)) {
           return false;
         }
       }
@@ -792,6 +823,7 @@ bool isSafeToStackAllocateArray(
       // We are super conservative here, the only thing we want to be able to
       // handle at this point is extracting len/ptr. More extensive analysis
       // could be added later.
+      Reason = "the array is used as a whole";
       return false;
     }
   }
@@ -820,9 +852,16 @@ bool isSafeToStackAllocateArray(
 /// If the value is used in a call instruction with the tail attribute set,
 /// the attribute has to be removed before promoting the memory to the
 /// stack. The affected instructions are added to RemoveTailCallInsts. If
-/// the function returns false, these entries are meaningless.
+/// the function returns false, these entries are meaningless and Reason says
+/// why.
+///
+/// The pointer may also be inserted into a first-class aggregate, which is
+/// how closure frames end up in delegates: as long as the aggregates are only
+/// built up further or have fields extracted, extracting the pointer back is
+/// treated like a derived pointer and the other fields are ignored.
 bool isSafeToStackAllocate(BasicBlock::iterator Alloc, Value *V, DominatorTree &DT,
-                           SmallVector<CallInst *, 4> &RemoveTailCallInsts) {
+                           SmallVector<CallInst *, 4> &RemoveTailCallInsts,
+                           const char *&Reason) {
   assert(isa<PointerType>(V->getType()) && "Allocated value is not a pointer?");
 
   SmallVector<Use *, 16> Worklist;
@@ -864,6 +903,7 @@ bool isSafeToStackAllocate(BasicBlock::iterator Alloc, Value *V, DominatorTree &
         if (A->get() == V) {
           if (!CS.paramHasAttr(A - B + 1, LLAttribute::NoCapture)) {
             // The parameter is not marked 'nocapture' - captured.
+            Reason = "passed to a parameter not known to be nocapture";
             return false;
           }
 
@@ -885,6 +925,7 @@ bool isSafeToStackAllocate(BasicBlock::iterator Alloc, Value *V, DominatorTree &
     case Instruction::Store:
       if (V == I->getOperand(0)) {
         // Stored the pointer - it may be captured.
+        Reason = "stored to memory";
         return false;
       }
       // Storing to the pointee does not cause the pointer to be captured.
@@ -896,6 +937,7 @@ bool isSafeToStackAllocate(BasicBlock::iterator Alloc, Value *V, DominatorTree &
       // It's not safe to stack-allocate if this derived pointer is live across
       // the original allocation.
       if (mayBeUsedAfterRealloc(I, Alloc, DT)) {
+        Reason = "a derived pointer is live across the next allocation";
         return false;
       }
 
@@ -912,8 +954,71 @@ bool isSafeToStackAllocate(BasicBlock::iterator Alloc, Value *V, DominatorTree &
         }
       }
       break;
+    case Instruction::InsertValue: {
+      if (V != cast<InsertValueInst>(I)->getInsertedValueOperand()) {
+        Reason = "used as an aggregate";
+        return false;
+      }
+
+      if (mayBeUsedAfterRealloc(I, Alloc, DT)) {
+        Reason = "a derived pointer is live across the next allocation";
+        return false;
+      }
+
+      // Follow the aggregates holding the pointer at the same indices, and
+      // carry on with the extractions of the pointer.
+      ArrayRef<unsigned> Indices = cast<InsertValueInst>(I)->getIndices();
+      SmallVector<Instruction *, 4> Aggregates(1, I);
+      while (!Aggregates.empty()) {
+        Instruction *Agg = Aggregates.pop_back_val();
+        for (Instruction::use_iterator UI = Agg->use_begin(),
+                                       UE = Agg->use_end();
+             UI != UE; ++UI) {
+          Instruction *AggUser = cast<Instruction>(UI->getUser());
+          if (auto EVI = dyn_cast<ExtractValueInst>(AggUser)) {
+            if (!isIndexPrefix(EVI->getIndices(), Indices)) {
+              continue; // another field
+            }
+            if (EVI->getNumIndices() != Indices.size()) {
+              // Extracts a member aggregate that holds the pointer.
+              Reason = "inserted into an aggregate used as a whole";
+              return false;
+            }
+            if (mayBeUsedAfterRealloc(EVI, Alloc, DT)) {
+              Reason = "a derived pointer is live across the next allocation";
+              return false;
+            }
+            for (Instruction::use_iterator EUI = EVI->use_begin(),
+                                           EUE = EVI->use_end();
+                 EUI != EUE; ++EUI) {
+              Use *EU = &(*EUI);
+#if LDC_LLVM_VER >= 306
+              if (Visited.insert(EU).second) {
+#else
+              if (Visited.insert(EU)) {
+#endif
+                Worklist.push_back(EU);
+              }
+            }
+          } else if (auto IVI = dyn_cast<InsertValueInst>(AggUser)) {
+            if (IVI->getAggregateOperand() != Agg) {
+              Reason = "inserted into an aggregate used as a whole";
+              return false;
+            }
+            if (!isIndexPrefix(IVI->getIndices(), Indices)) {
+              Aggregates.push_back(IVI); // still holding the pointer
+            }
+          } else {
+            Reason = "inserted into an aggregate used as a whole";
+            return false;
+          }
+        }
+      }
+      break;
+    }
     default:
       // Something else - be conservative and say it is captured.
+      Reason = "used by an instruction that may capture it";
       return false;
     }
   }
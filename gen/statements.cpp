@@ -30,7 +30,9 @@
 #include "llvm/IR/CFG.h"
 #include "llvm/IR/InlineAsm.h"
 #include <fstream>
+#include <map>
 #include <math.h>
+#include <set>
 #include <stdio.h>
 
 // Need to include this after the other DMD includes because of missing
@@ -44,52 +46,92 @@ void CompoundAsmStatement_toIR(CompoundAsmStatement *stmt, IRState *p);
 
 //////////////////////////////////////////////////////////////////////////////
 
-// used to build the sorted list of cases
-struct Case : RootObject {
-  StringExp *str;
-  size_t index;
-
-  Case(StringExp *s, size_t i) {
-    str = s;
-    index = i;
+// String switches are lowered to a decision tree: a switch on the length,
+// then switches on the code units telling the remaining cases apart, down to a
+// single candidate which is checked with one memcmp.
+
+static void emitStringSwitchLeaf(IRState *irs, LLValue *condPtr,
+                                 CaseStatement *cs,
+                                 llvm::BasicBlock *nomatchbb) {
+  StringExp *se = static_cast<StringExp *>(cs->exp);
+  if (se->len == 0) {
+    llvm::BranchInst::Create(cs->bodyBB, irs->scopebb());
+    return;
   }
 
-  int compare(RootObject *obj) override {
-    Case *c2 = static_cast<Case *>(obj);
-    return str->compare(c2->str);
+  LLConstant *str = toConstElem(se, irs);
+  LLValue *val = DtoMemCmp(condPtr, str->getAggregateElement(1u),
+                           DtoConstSize_t(se->len * se->sz));
+  LLValue *cmp = irs->ir->CreateICmpEQ(
+      val, LLConstantInt::get(val->getType(), 0, false), "stringswitch.match");
+  irs->ir->CreateCondBr(cmp, cs->bodyBB, nomatchbb);
+}
+
+// cases all have the same length.
+static void emitStringSwitchTree(IRState *irs, LLValue *condPtr,
+                                 const std::vector<CaseStatement *> &cases,
+                                 llvm::BasicBlock *nomatchbb) {
+  if (cases.size() == 1) {
+    emitStringSwitchLeaf(irs, condPtr, cases[0], nomatchbb);
+    return;
   }
-};
 
-static LLValue *call_string_switch_runtime(llvm::Value *table, Expression *e) {
-  Type *dt = e->type->toBasetype();
-  Type *dtnext = dt->nextOf()->toBasetype();
-  TY ty = dtnext->ty;
-  const char *fname;
-  if (ty == Tchar) {
-    fname = "_d_switch_string";
-  } else if (ty == Twchar) {
-    fname = "_d_switch_ustring";
-  } else if (ty == Tdchar) {
-    fname = "_d_switch_dstring";
-  } else {
-    llvm_unreachable("not char/wchar/dchar");
+  // Switch on the code unit splitting the cases into the most groups
+  size_t len = static_cast<StringExp *>(cases[0]->exp)->len;
+  size_t bestPos = 0, bestCount = 0;
+  for (size_t pos = 0; pos < len; ++pos) {
+    std::set<unsigned> units;
+    for (auto cs : cases) {
+      units.insert(static_cast<StringExp *>(cs->exp)->charAt(pos));
+    }
+    if (units.size() > bestCount) {
+      bestPos = pos;
+      bestCount = units.size();
+    }
   }
+  assert(bestCount > 1 && "duplicate string cases");
 
-  llvm::Function *fn = getRuntimeFunction(e->loc, gIR->module, fname);
+  std::map<unsigned, std::vector<CaseStatement *>> groups;
+  for (auto cs : cases) {
+    groups[static_cast<StringExp *>(cs->exp)->charAt(bestPos)].push_back(cs);
+  }
 
-  IF_LOG {
-    Logger::cout() << *table->getType() << '\n';
-    Logger::cout() << *fn->getFunctionType()->getParamType(0) << '\n';
+  LLValue *unit = DtoLoad(DtoGEP1(condPtr, DtoConstSize_t(bestPos), true),
+                          "stringswitch.unit");
+  llvm::SwitchInst *si = llvm::SwitchInst::Create(unit, nomatchbb,
+                                                  groups.size(), irs->scopebb());
+  for (auto &group : groups) {
+    llvm::BasicBlock *bb = llvm::BasicBlock::Create(
+        irs->context(), "stringswitch.unit", irs->topfunc());
+    si->addCase(LLConstantInt::get(llvm::cast<llvm::IntegerType>(
+                                       unit->getType()), group.first, false),
+                bb);
+    irs->scope() = IRScope(bb);
+    emitStringSwitchTree(irs, condPtr, group.second, nomatchbb);
   }
-  assert(table->getType() == fn->getFunctionType()->getParamType(0));
+}
 
-  DValue *val = toElemDtor(e);
-  LLValue *llval = val->getRVal();
-  assert(llval->getType() == fn->getFunctionType()->getParamType(1));
+static void emitStringSwitch(IRState *irs, SwitchStatement *stmt,
+                             llvm::BasicBlock *nomatchbb) {
+  DValue *cond = toElemDtor(stmt->condition);
+  LLValue *condLen = DtoArrayLen(cond);
+  LLValue *condPtr = DtoArrayPtr(cond);
 
-  LLCallSite call = gIR->CreateCallOrInvoke(fn, table, llval);
+  std::map<size_t, std::vector<CaseStatement *>> lengths;
+  for (auto cs : *stmt->cases) {
+    assert(cs->exp->op == TOKstring);
+    lengths[static_cast<StringExp *>(cs->exp)->len].push_back(cs);
+  }
 
-  return call.getInstruction();
+  llvm::SwitchInst *si = llvm::SwitchInst::Create(
+      condLen, nomatchbb, lengths.size(), irs->scopebb());
+  for (auto &length : lengths) {
+    llvm::BasicBlock *bb = llvm::BasicBlock::Create(
+        irs->context(), "stringswitch.length", irs->topfunc());
+    si->addCase(DtoConstSize_t(length.first), bb);
+    irs->scope() = IRScope(bb);
+    emitStringSwitchTree(irs, condPtr, length.second, nomatchbb);
+  }
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -917,67 +959,19 @@ public:
 
     irs->scope() = IRScope(oldbb);
     if (useSwitchInst) {
-      // string switch?
-      llvm::Value *switchTable = nullptr;
-      Objects caseArray;
       if (!stmt->condition->type->isintegral()) {
         Logger::println("is string switch");
-        // build array of the stringexpS
-        caseArray.reserve(stmt->cases->dim);
-        for (unsigned i = 0; i < stmt->cases->dim; ++i) {
-          CaseStatement *cs =
-              static_cast<CaseStatement *>(stmt->cases->data[i]);
-
-          assert(cs->exp->op == TOKstring);
-          caseArray.push(new Case(static_cast<StringExp *>(cs->exp), i));
-        }
-        // first sort it
-        caseArray.sort();
-        // iterate and add indices to cases
-        std::vector<llvm::Constant *> inits(caseArray.dim, nullptr);
-        for (size_t i = 0; i < caseArray.dim; ++i) {
-          Case *c = static_cast<Case *>(caseArray.data[i]);
-          CaseStatement *cs =
-              static_cast<CaseStatement *>(stmt->cases->data[c->index]);
-          cs->llvmIdx = DtoConstUint(i);
-          inits[i] = toConstElem(c->str, irs);
-        }
-        // build static array for ptr or final array
-        llvm::Type *elemTy = DtoType(stmt->condition->type);
-        LLArrayType *arrTy = llvm::ArrayType::get(elemTy, inits.size());
-        LLConstant *arrInit = LLConstantArray::get(arrTy, inits);
-        auto arr = new llvm::GlobalVariable(
-            irs->module, arrTy, true, llvm::GlobalValue::InternalLinkage,
-            arrInit, ".string_switch_table_data");
-
-        LLType *elemPtrTy = getPtrToType(elemTy);
-        LLConstant *arrPtr = llvm::ConstantExpr::getBitCast(arr, elemPtrTy);
-
-        // build the static table
-        LLType *types[] = {DtoSize_t(), elemPtrTy};
-        LLStructType *sTy = llvm::StructType::get(irs->context(), types, false);
-        LLConstant *sinits[] = {DtoConstSize_t(inits.size()), arrPtr};
-        switchTable = llvm::ConstantStruct::get(
-            sTy, llvm::ArrayRef<LLConstant *>(sinits));
-      }
-
-      // condition var
-      LLValue *condVal;
-      // integral switch
-      if (stmt->condition->type->isintegral()) {
+        emitStringSwitch(irs, stmt, defbb ? defbb : endbb);
+      } else {
         DValue *cond = toElemDtor(stmt->condition);
-        condVal = cond->getRVal();
-      }
-      // string switch
-      else {
-        condVal = call_string_switch_runtime(switchTable, stmt->condition);
-      }
+        LLValue *condVal = cond->getRVal();
 
-      // create switch and add the cases
-      llvm::SwitchInst *si = llvm::SwitchInst::Create(
-          condVal, defbb ? defbb : endbb, stmt->cases->dim, irs->scopebb());
-      for (auto cs : *stmt->cases) {
-        si->addCase(isaConstantInt(cs->llvmIdx), cs->bodyBB);
+        // create switch and add the cases
+        llvm::SwitchInst *si = llvm::SwitchInst::Create(
+            condVal, defbb ? defbb : endbb, stmt->cases->dim, irs->scopebb());
+        for (auto cs : *stmt->cases) {
+          si->addCase(isaConstantInt(cs->llvmIdx), cs->bodyBB);
+        }
       }
     } else { // we can't use switch, so we will use a bunch of br instructions
              // instead
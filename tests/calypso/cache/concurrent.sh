@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# Several ldc2 processes sharing a cache directory: only one of them generates the PCH while the others wait for it,
+# and the cache files are always replaced as a whole.
+
+set -e
+cd "$(dirname "$0")"
+rm -rf cache_dir concurrent
+mkdir -p cache_dir concurrent/1 concurrent/2 concurrent/3 concurrent/4
+
+pids=""
+for i in 1 2 3 4; do
+    ldc2 -cpp-cachedir=cache_dir -od=concurrent/$i -of=concurrent/$i/both both.d -L-lstdc++ &
+    pids="$pids $!"
+done
+
+for pid in $pids; do
+    wait $pid
+done
+
+for i in 1 2 3 4; do
+    concurrent/$i/both
+done
+
+# The cache written by whichever process won is complete and up-to-date
+ldc2 -v -cpp-cachedir=cache_dir -od=concurrent -of=concurrent/both both.d -L-lstdc++ > concurrent/build.log
+if grep -q "^dirty" concurrent/build.log; then echo "the shared PCH is dirty"; exit 1; fi
+test ! -f cache_dir/calypso_cache.h.pch.lock
+ls cache_dir | grep -q -- "-........$" && { echo "temporary cache files were left behind"; exit 1; }
+
+echo "concurrent cache OK"
+rm -rf cache_dir concurrent
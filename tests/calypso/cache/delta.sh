@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# Headers modmapped after the PCH was generated get parsed into a chained delta PCH, instead of having every header
+# reparsed.
+
+set -e
+cd "$(dirname "$0")"
+rm -rf cache_dir first both
+mkdir cache_dir
+
+ldc2 -cpp-cachedir=cache_dir first.d -L-lstdc++
+./first
+test -f cache_dir/calypso_cache.h.pch
+test ! -f cache_dir/calypso_cache.delta1.h.pch
+
+# second.hpp is parsed on top of the cached PCH
+ldc2 -cpp-cachedir=cache_dir both.d -L-lstdc++
+./both
+test -f cache_dir/calypso_cache.delta1.h.pch
+grep -q "second.hpp" cache_dir/calypso_cache.delta1.h
+
+# Nothing new, the PCH chain is loaded as is
+ldc2 -cpp-cachedir=cache_dir both.d -L-lstdc++
+./both
+test ! -f cache_dir/calypso_cache.delta2.h.pch
+
+echo "delta PCH OK"
+rm -rf cache_dir first both *.o
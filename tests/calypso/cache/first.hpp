@@ -0,0 +1,5 @@
+#pragma once
+
+namespace cache {
+    inline int first() { return 1; }
+}
@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# The manifest lets the cached PCH be validated up front: touching a header doesn't invalidate the PCH as long as its
+# contents are the same, modifying it does.
+
+set -e
+cd "$(dirname "$0")"
+rm -rf work
+mkdir -p work/cache_dir
+cp first.hpp first.d work/
+cd work
+
+ldc2 -cpp-cachedir=cache_dir first.d -L-lstdc++
+./first
+grep -q "^#manifest" cache_dir/calypso_cache
+
+# Only the modification time changed
+sleep 1
+touch first.hpp
+ldc2 -v -cpp-cachedir=cache_dir first.d -L-lstdc++ > build.log
+if grep -q "^dirty" build.log; then echo "the PCH shouldn't be dirty"; exit 1; fi
+./first
+
+# Same size, different contents
+sed -i 's/return 1;/return 7;/' first.hpp
+ldc2 -v -cpp-cachedir=cache_dir first.d -L-lstdc++ > build.log
+grep -q "^dirty .*first.hpp (contents changed)" build.log
+if ./first 2> /dev/null; then echo "the PCH wasn't regenerated"; exit 1; fi
+
+echo "manifest OK"
+cd ..
+rm -rf work
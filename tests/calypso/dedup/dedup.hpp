@@ -0,0 +1,8 @@
+#pragma once
+
+namespace dedup {
+    template<typename T>
+    T twice(T t) { return t + t; }
+
+    inline int thrice(int n) { return n * 3; }
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# With -cpp-dedup-instances the C++ template instances and inline functions used by several modules are emitted once,
+# into __cpp_instances.o, instead of into the object file of every module.
+
+set -e
+cd "$(dirname "$0")"
+rm -rf cache_dir objs dedup
+mkdir -p cache_dir objs
+
+countDefs() {
+    nm -C --defined-only "$@" 2> /dev/null | grep -c "$SYMBOL" || true
+}
+
+# Linking: the instances object lives in the cache directory and gets linked in
+ldc2 -cpp-cachedir=cache_dir -cpp-dedup-instances -od=objs -of=dedup a.d b.d -L-lstdc++
+./dedup
+test -f cache_dir/__cpp_instances.o
+SYMBOL="dedup::twice<int>(int)"
+test "$(countDefs objs/a.o objs/b.o)" = 0
+test "$(countDefs cache_dir/__cpp_instances.o)" = 1
+
+# -c: __cpp_instances.o is written next to the other object files, to be linked along with them
+rm -rf objs cache_dir && mkdir -p objs cache_dir
+ldc2 -c -cpp-cachedir=cache_dir -cpp-dedup-instances -od=objs a.d
+ldc2 -c -cpp-cachedir=cache_dir -cpp-dedup-instances -od=objs b.d
+test -f objs/__cpp_instances.o
+ldc2 -of=dedup objs/a.o objs/b.o objs/__cpp_instances.o -L-lstdc++
+./dedup
+
+# The instances no object file uses anymore are pruned
+SYMBOL="dedup::twice<double>(double)"
+test "$(countDefs objs/__cpp_instances.o)" = 1
+rm objs/a.o
+ldc2 -c -cpp-cachedir=cache_dir -cpp-dedup-instances -od=objs b.d
+test "$(countDefs objs/__cpp_instances.o)" = 0
+SYMBOL="dedup::twice<int>(int)"
+test "$(countDefs objs/__cpp_instances.o)" = 1 # still used by b.o
+
+echo "dedup instances OK"
+rm -rf cache_dir objs dedup
@@ -0,0 +1,24 @@
+#pragma once
+
+namespace lazy {
+    // Plain methods are only mapped when they're looked up from D
+    class Counter
+    {
+    public:
+        int count;
+
+        Counter() { count = 0; }
+
+        void increment() { count++; }
+        void add(int n) { count += n; }
+        void add(int n, int times) { count += n * times; }
+        int get() const { return count; }
+        void reset() { count = 0; }
+    };
+
+    class DoubleCounter : public Counter
+    {
+    public:
+        void incrementTwice() { increment(); increment(); }
+    };
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+namespace mods {
+    struct Point
+    {
+        int x, y;
+    };
+
+    inline int manhattan(const Point& p) { return (p.x < 0 ? -p.x : p.x) + (p.y < 0 ? -p.y : p.y); }
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "core.hpp"
+
+namespace mods {
+    inline Point mirror(const Point& p) { Point r = { -p.x, -p.y }; return r; }
+}
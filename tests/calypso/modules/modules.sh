@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# With -cpp-module-jobs N the Clang modules described by the .modulemap_d files next to the headers are built by up to
+# N worker processes before the headers are parsed, and the PCH imports them.
+
+set -e
+cd "$(dirname "$0")"
+rm -rf cache_dir modules
+mkdir cache_dir
+
+ldc2 -cpp-cachedir=cache_dir -cpp-module-jobs=2 modules.d -L-lstdc++
+./modules
+test -f cache_dir/calypso_cache.mods_core.pcm
+test -f cache_dir/calypso_cache.mods_extra.pcm
+grep -q "^mods_core	" cache_dir/calypso_cache
+grep -q "^mods_extra	" cache_dir/calypso_cache
+
+# The PCH saved on top of the module files is loaded by the next build
+ldc2 -v -cpp-cachedir=cache_dir -cpp-module-jobs=2 modules.d -L-lstdc++ > build.log
+if grep -q "^dirty" build.log; then echo "the PCH shouldn't be dirty"; exit 1; fi
+./modules
+
+echo "module jobs OK"
+rm -rf cache_dir modules build.log *.o
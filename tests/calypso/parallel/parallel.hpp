@@ -0,0 +1,12 @@
+#pragma once
+
+namespace parallel {
+    template<typename T>
+    struct Accumulator
+    {
+        T sum;
+
+        Accumulator() : sum() {}
+        void add(T t) { sum += t; }
+    };
+}
@@ -0,0 +1,25 @@
+#!/bin/sh
+#
+# -j N optimizes and emits the object files on N threads, the result has to be the same as with a single one.
+
+set -e
+cd "$(dirname "$0")"
+rm -rf objs1 objs4 parallel parallel_single
+
+ldc2 -O -od=objs1 -of=parallel a.d b.d c.d main.d -L-lstdc++
+ldc2 -O -j=4 -od=objs4 -of=parallel a.d b.d c.d main.d -L-lstdc++
+./parallel
+for m in a b c main; do
+    cmp objs1/$m.o objs4/$m.o
+done
+
+ldc2 -O -j=4 -singleobj -od=objs4 -of=parallel_single a.d b.d c.d main.d -L-lstdc++
+./parallel_single
+
+# The errors of the workers are reported once they're joined, instead of killing the process from a worker thread
+touch not_a_dir
+if ldc2 -j=4 -c -od=not_a_dir a.d b.d c.d 2> errors.log; then echo "writing into a file succeeded"; exit 1; fi
+grep -q "Error" errors.log
+
+echo "parallel codegen OK"
+rm -rf objs1 objs4 parallel parallel_single not_a_dir errors.log
@@ -0,0 +1,68 @@
+#include "rvalue.hpp"
+
+namespace rvalue
+{
+
+CtorKind lastCtor = None;
+
+Movable::Movable() : p(new int(1)) {}
+
+Movable::Movable(const Movable& o) : p(new int(*o.p))
+{
+    lastCtor = Copy;
+}
+
+Movable::Movable(Movable&& o) : p(o.p)
+{
+    o.p = nullptr;
+    lastCtor = Move;
+}
+
+Movable::~Movable()
+{
+    delete p;
+}
+
+CopyOnly::CopyOnly(const CopyOnly& o) : n(o.n)
+{
+    lastCtor = Copy;
+}
+
+CopyAssign& CopyAssign::operator=(const CopyAssign& o)
+{
+    n = o.n;
+    return *this;
+}
+
+int consume(const Movable& m)
+{
+    return 2;
+}
+
+int consume(Movable&& m)
+{
+    Movable stolen(static_cast<Movable&&>(m));
+    return 1;
+}
+
+int consume(const CopyOnly& c)
+{
+    return c.n;
+}
+
+int take(CopyOnly c)
+{
+    return c.n;
+}
+
+Movable makeMovable()
+{
+    return Movable();
+}
+
+CopyOnly makeCopyOnly()
+{
+    return CopyOnly();
+}
+
+}
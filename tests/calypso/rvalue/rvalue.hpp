@@ -0,0 +1,50 @@
+#pragma once
+
+namespace rvalue {
+    enum CtorKind { None, Copy, Move };
+    extern CtorKind lastCtor; // set by the copy and move constructors below
+
+    // Trivially copyable
+    struct Pod
+    {
+        int a;
+        float b;
+    };
+
+    // Non-trivial move constructor and destructor
+    struct Movable
+    {
+        int *p;
+
+        Movable();
+        Movable(const Movable& o);
+        Movable(Movable&& o);
+        ~Movable();
+    };
+
+    // No move constructor, so rvalues are copied through the non-trivial copy constructor
+    struct CopyOnly
+    {
+        int n;
+
+        CopyOnly() { n = 2; }
+        CopyOnly(const CopyOnly& o);
+    };
+
+    // No move constructor either, but the copy constructor and destructor are trivial
+    struct CopyAssign
+    {
+        int n;
+
+        CopyAssign& operator=(const CopyAssign& o);
+    };
+
+    int consume(const Movable& m); // returns 2
+    int consume(Movable&& m); // returns 1
+    int consume(const CopyOnly& c); // returns c.n
+
+    int take(CopyOnly c); // returns c.n
+
+    Movable makeMovable();
+    CopyOnly makeCopyOnly();
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+namespace tmpl {
+    template<typename T>
+    struct Box
+    {
+        T value;
+
+        T get() const { return value; }
+        T negated() const { return -value; } // only valid if T has a unary minus
+        void set(const T& v) { value = v; }
+    };
+
+    struct NoMinus
+    {
+        int n;
+    };
+
+    inline Box<int> makeIntBox(int n) { Box<int> b; b.value = n; return b; }
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+namespace accessor {
+    struct Counter {
+        int n;
+        int get() const { return n; }
+    };
+}